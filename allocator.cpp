@@ -0,0 +1,482 @@
+#include "allocator.hpp"
+#include <algorithm>
+#include <iterator>
+#include <assert.h>
+#include "metrics.hpp"
+
+using std::lock_guard;
+using std::max;
+using std::min;
+using std::mutex;
+using std::pair;
+using std::vector;
+
+const uint WORD_BITS = 64;
+
+BlockAllocator::BlockAllocator(uint num_blocks)
+    : num_blocks(num_blocks) {
+  reset_locked();
+}
+
+void BlockAllocator::reset() {
+  lock_guard<mutex> guard(lock);
+  reset_locked();
+}
+
+void BlockAllocator::reset_locked() {
+  shared.clear();
+  shared_count = 0;
+  by_fingerprint.clear();
+  fingerprints.clear();
+  held.clear();
+  held_count = 0;
+  uint num_words = (num_blocks + WORD_BITS - 1) / WORD_BITS;
+  num_leaves = 1;
+  while (num_leaves < num_words) {
+    num_leaves *= 2;
+  }
+
+  // blocks past the end of the disk are permanently used
+  bits.assign(num_leaves, ~0ULL);
+  for (uint w = 0; w < num_words; ++w) {
+    uint valid = min(WORD_BITS, num_blocks - w * WORD_BITS);
+    bits[w] = valid == WORD_BITS ? 0 : ~0ULL << valid;
+  }
+
+  tree.resize(2 * num_leaves);
+  update(0, num_leaves - 1);
+}
+
+BlockAllocator::Summary BlockAllocator::summarize(uint64_t word) {
+  uint64_t free = ~word;
+  Summary s;
+  s.pre = word == 0 ? WORD_BITS : __builtin_ctzll(word);
+  s.suf = word == 0 ? WORD_BITS : __builtin_clzll(word);
+  s.free = __builtin_popcountll(free);
+  // a run starts at every free bit whose lower neighbour is used
+  s.runs = __builtin_popcountll(free & ~(free << 1));
+  s.best = 0;
+  for (uint64_t x = free; x != 0; x &= x << 1) {
+    ++s.best;
+  }
+  return s;
+}
+
+BlockAllocator::Summary BlockAllocator::combine(const Summary &a,
+                                                const Summary &b,
+                                                uint len_a, uint len_b) {
+  Summary s;
+  s.pre = a.pre == len_a ? len_a + b.pre : a.pre;
+  s.suf = b.suf == len_b ? len_b + a.suf : b.suf;
+  s.best = max(max(a.best, b.best), a.suf + b.pre);
+  s.free = a.free + b.free;
+  s.runs = a.runs + b.runs - (a.suf > 0 && b.pre > 0 ? 1 : 0);
+  return s;
+}
+
+// recompute the summaries covering words first_word..last_word
+void BlockAllocator::update(uint first_word, uint last_word) {
+  uint lo = first_word + num_leaves;
+  uint hi = last_word + num_leaves;
+  for (uint i = lo; i <= hi; ++i) {
+    tree[i] = summarize(bits[i - num_leaves]);
+  }
+  uint child_len = WORD_BITS;
+  while (lo > 1) {
+    lo /= 2;
+    hi /= 2;
+    for (uint i = lo; i <= hi; ++i) {
+      tree[i] = combine(tree[2 * i], tree[2 * i + 1], child_len, child_len);
+    }
+    child_len *= 2;
+  }
+}
+
+void BlockAllocator::set_range(uint start, uint count, bool used) {
+  assert(start + count <= num_blocks);
+  if (count == 0) {
+    return;
+  }
+  uint end = start + count;
+  for (uint b = start; b < end;) {
+    uint w = b / WORD_BITS;
+    uint lo = b % WORD_BITS;
+    uint n = min(WORD_BITS - lo, end - b);
+    uint64_t mask = (n == WORD_BITS ? ~0ULL : ((1ULL << n) - 1)) << lo;
+    if (used) {
+      assert((bits[w] & mask) == 0);
+      bits[w] |= mask;
+    } else {
+      assert((bits[w] & mask) == mask);
+      bits[w] &= ~mask;
+    }
+    b += n;
+  }
+  update(start / WORD_BITS, (end - 1) / WORD_BITS);
+}
+
+// find the lowest addressed run of at least count free blocks
+bool BlockAllocator::find_run(uint count, uint *start) const {
+  if (count == 0 || tree[1].best < count) {
+    return false;
+  }
+
+  uint node = 1;
+  uint node_start = 0;
+  uint node_len = num_leaves * WORD_BITS;
+  while (node < num_leaves) {
+    uint half = node_len / 2;
+    const Summary &left = tree[2 * node];
+    const Summary &right = tree[2 * node + 1];
+    if (left.best >= count) {
+      node = 2 * node;
+    } else if (left.suf + right.pre >= count) {
+      // the run straddles the two halves
+      *start = node_start + half - left.suf;
+      return true;
+    } else {
+      node = 2 * node + 1;
+      node_start += half;
+    }
+    node_len = half;
+  }
+
+  // the run lies inside a single word
+  uint64_t free = ~bits[node - num_leaves];
+  uint64_t fits = free;
+  for (uint i = 1; i < count; ++i) {
+    fits &= free >> i;
+  }
+  assert(fits != 0);
+  *start = node_start + __builtin_ctzll(fits);
+  return true;
+}
+
+bool BlockAllocator::allocate(uint count, vector<pair<uint, uint>> *runs) {
+  lock_guard<mutex> guard(lock);
+  if (count > tree[1].free) {
+    return false;
+  }
+
+  // take the whole request from one run if we can, otherwise fill it
+  // from the largest runs available to keep the file in few pieces
+  while (count > 0) {
+    uint len = min(count, tree[1].best);
+    uint start;
+    bool found = find_run(len, &start);
+    assert(found);
+    (void) found;
+    set_range(start, len, true);
+    runs->push_back(std::make_pair(start, len));
+    Metrics::count(Metrics::BLOCKS_ALLOCATED, len);
+    count -= len;
+  }
+  return true;
+}
+
+bool BlockAllocator::allocate_run(uint count, uint *start) {
+  lock_guard<mutex> guard(lock);
+  if (!find_run(count, start)) {
+    return false;
+  }
+  set_range(*start, count, true);
+  Metrics::count(Metrics::BLOCKS_ALLOCATED, count);
+  return true;
+}
+
+void BlockAllocator::reserve(uint start, uint count) {
+  lock_guard<mutex> guard(lock);
+  set_range(start, count, true);
+}
+
+// make sure no shared run straddles block at
+void BlockAllocator::split_shared(uint at) {
+  auto it = shared.upper_bound(at);
+  if (it == shared.begin()) {
+    return;
+  }
+  --it;
+  uint end = it->first + it->second.length;
+  if (it->first < at && at < end) {
+    shared[at] = SharedRun{end - at, it->second.refs};
+    it->second.length = at - it->first;
+  }
+}
+
+// join adjacent shared runs with equal counts around start..end
+void BlockAllocator::merge_shared(uint start, uint end) {
+  auto it = shared.lower_bound(start);
+  if (it != shared.begin()) {
+    --it;
+  }
+  while (it != shared.end() && it->first <= end) {
+    auto next = std::next(it);
+    if (next != shared.end() &&
+        it->first + it->second.length == next->first &&
+        it->second.refs == next->second.refs) {
+      it->second.length += next->second.length;
+      shared.erase(next);
+    } else {
+      it = next;
+    }
+  }
+}
+
+void BlockAllocator::share(uint start, uint count) {
+  lock_guard<mutex> guard(lock);
+  share_locked(start, count);
+}
+
+void BlockAllocator::share_locked(uint start, uint count) {
+  uint end = start + count;
+  split_shared(start);
+  split_shared(end);
+  uint b = start;
+  auto it = shared.lower_bound(start);
+  while (b < end) {
+    if (it != shared.end() && it->first == b) {
+      ++it->second.refs;
+      b += it->second.length;
+      ++it;
+    } else {
+      // a gap of singly owned blocks up to the next shared run
+      uint gap_end = it != shared.end() ? min(end, it->first) : end;
+      assert(!block_free(b));
+      shared.emplace_hint(it, b, SharedRun{gap_end - b, 2});
+      shared_count += gap_end - b;
+      b = gap_end;
+    }
+  }
+  merge_shared(start, end);
+}
+
+void BlockAllocator::free(uint start, uint count) {
+  lock_guard<mutex> guard(lock);
+  uint end = start + count;
+  split_shared(start);
+  split_shared(end);
+  vector<pair<uint, uint>> released;
+  uint b = start;
+  auto it = shared.lower_bound(start);
+  while (b < end) {
+    if (it != shared.end() && it->first == b) {
+      b += it->second.length;
+      if (--it->second.refs == 1) {
+        shared_count -= it->second.length;
+        it = shared.erase(it);
+      } else {
+        ++it;
+      }
+    } else {
+      uint gap_end = it != shared.end() ? min(end, it->first) : end;
+      released.push_back(std::make_pair(b, gap_end - b));
+      b = gap_end;
+    }
+  }
+  merge_shared(start, end);
+
+  for (auto &run : released) {
+    forget_locked(run.first, run.second);
+    Metrics::count(Metrics::BLOCKS_FREED, run.second);
+    if (hold) {
+      held.push_back(HeldRun{run.first, run.second, hold()});
+      held_count += run.second;
+    } else {
+      release_run(run.first, run.second);
+    }
+  }
+}
+
+void BlockAllocator::release_run(uint start, uint count) {
+  set_range(start, count, false);
+  if (on_free) {
+    on_free(start, count);
+  }
+}
+
+void BlockAllocator::release(uint64_t upto) {
+  lock_guard<mutex> guard(lock);
+  while (!held.empty() && held.front().tag <= upto) {
+    held_count -= held.front().count;
+    release_run(held.front().start, held.front().count);
+    held.pop_front();
+  }
+}
+
+void BlockAllocator::release_all() {
+  lock_guard<mutex> guard(lock);
+  for (auto &run : held) {
+    release_run(run.start, run.count);
+  }
+  held.clear();
+  held_count = 0;
+}
+
+uint BlockAllocator::held_blocks() const {
+  lock_guard<mutex> guard(lock);
+  return held_count;
+}
+
+uint BlockAllocator::held_extents() const {
+  lock_guard<mutex> guard(lock);
+  return held.size();
+}
+
+void BlockAllocator::set_fingerprint(uint block, uint64_t fingerprint) {
+  lock_guard<mutex> guard(lock);
+  assert(!block_free(block));
+  forget_locked(block, 1);
+  if (by_fingerprint.emplace(fingerprint, block).second) {
+    fingerprints[block] = fingerprint;
+  }
+}
+
+bool BlockAllocator::share_fingerprint(uint64_t fingerprint, uint *block) {
+  lock_guard<mutex> guard(lock);
+  auto it = by_fingerprint.find(fingerprint);
+  if (it == by_fingerprint.end()) {
+    return false;
+  }
+  *block = it->second;
+  share_locked(*block, 1);
+  return true;
+}
+
+void BlockAllocator::forget(uint start, uint count) {
+  lock_guard<mutex> guard(lock);
+  forget_locked(start, count);
+}
+
+void BlockAllocator::forget_locked(uint start, uint count) {
+  if (fingerprints.empty()) {
+    return;
+  }
+  uint end = start + count;
+  if (count <= fingerprints.size()) {
+    for (uint b = start; b < end; ++b) {
+      auto it = fingerprints.find(b);
+      if (it != fingerprints.end()) {
+        by_fingerprint.erase(it->second);
+        fingerprints.erase(it);
+      }
+    }
+    return;
+  }
+  // a long run: cheaper to go through the labels
+  for (auto it = fingerprints.begin(); it != fingerprints.end();) {
+    if (it->first >= start && it->first < end) {
+      by_fingerprint.erase(it->second);
+      it = fingerprints.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+uint BlockAllocator::fingerprinted() const {
+  lock_guard<mutex> guard(lock);
+  return fingerprints.size();
+}
+
+bool BlockAllocator::is_shared(uint block, uint *run) const {
+  lock_guard<mutex> guard(lock);
+  auto it = shared.upper_bound(block);
+  if (it != shared.begin()) {
+    auto prev_it = std::prev(it);
+    if (block < prev_it->first + prev_it->second.length) {
+      *run = prev_it->first + prev_it->second.length - block;
+      return true;
+    }
+  }
+  *run = (it != shared.end() ? it->first : num_blocks) - block;
+  return false;
+}
+
+void BlockAllocator::shared_runs(vector<pair<pair<uint, uint>, uint>> *runs) const {
+  lock_guard<mutex> guard(lock);
+  for (auto &kv : shared) {
+    runs->push_back(std::make_pair(std::make_pair(kv.first, kv.second.length),
+                                   kv.second.refs));
+  }
+}
+
+bool BlockAllocator::is_free(uint block) const {
+  lock_guard<mutex> guard(lock);
+  return block_free(block);
+}
+
+bool BlockAllocator::block_free(uint block) const {
+  return block < num_blocks &&
+      (bits[block / WORD_BITS] & (1ULL << (block % WORD_BITS))) == 0;
+}
+
+void BlockAllocator::free_runs(vector<pair<uint, uint>> *runs,
+                               bool with_held) const {
+  lock_guard<mutex> guard(lock);
+  uint run_start = 0;
+  uint run_len = 0;
+  for (uint b = 0; b < num_blocks;) {
+    uint64_t word = bits[b / WORD_BITS];
+    if (b % WORD_BITS == 0 && (word == 0 || word == ~0ULL)) {
+      // skip whole words at a time where we can
+      uint n = min(WORD_BITS, num_blocks - b);
+      if (word == 0) {
+        if (run_len == 0) {
+          run_start = b;
+        }
+        run_len += n;
+      } else if (run_len > 0) {
+        runs->push_back(std::make_pair(run_start, run_len));
+        run_len = 0;
+      }
+      b += n;
+      continue;
+    }
+    if (block_free(b)) {
+      if (run_len == 0) {
+        run_start = b;
+      }
+      ++run_len;
+    } else if (run_len > 0) {
+      runs->push_back(std::make_pair(run_start, run_len));
+      run_len = 0;
+    }
+    ++b;
+  }
+  if (run_len > 0) {
+    runs->push_back(std::make_pair(run_start, run_len));
+  }
+  if (with_held) {
+    for (auto &run : held) {
+      runs->push_back(std::make_pair(run.start, run.count));
+    }
+  }
+}
+
+uint BlockAllocator::free_blocks() const {
+  lock_guard<mutex> guard(lock);
+  return tree[1].free;
+}
+
+uint BlockAllocator::largest_free_run() const {
+  lock_guard<mutex> guard(lock);
+  return tree[1].best;
+}
+
+uint BlockAllocator::free_extents() const {
+  lock_guard<mutex> guard(lock);
+  return tree[1].runs;
+}
+
+uint BlockAllocator::shared_blocks() const {
+  lock_guard<mutex> guard(lock);
+  return shared_count;
+}
+
+double BlockAllocator::fragmentation() const {
+  lock_guard<mutex> guard(lock);
+  if (tree[1].free == 0) {
+    return 0;
+  }
+  return 1 - static_cast<double>(tree[1].best) / tree[1].free;
+}
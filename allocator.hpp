@@ -0,0 +1,145 @@
+#ifndef _ALLOCATOR_H_
+#define _ALLOCATOR_H_
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <sys/types.h>
+
+// Hands out runs of disk blocks. Block state lives in a bitmap (one bit
+// per block, set when used) and a segment tree over the bitmap words
+// records, for every range of words, the free prefix, free suffix and
+// longest free run. That lets allocate find the first run of a given
+// length in O(log n) and makes freed runs coalesce with their
+// neighbours for free.
+//
+// Blocks can be shared between several owners (copy-on-write copies).
+// Reference counts are only kept for shared blocks, as runs of blocks
+// with the same count, so they cost O(shared extents) rather than
+// O(blocks); a used block with no run has a single owner.
+//
+// For deduplication, used blocks can be labelled with a fingerprint of
+// their contents, so that a block about to be written with the same
+// data can gain an owner instead. Looking a label up and sharing its
+// block happen under one lock, so a block can't be freed in between; a
+// label goes when its block is freed.
+//
+// Freed blocks can be held back from reuse until whatever recorded the
+// free is durable (see hold); until then they count as used.
+//
+// Every public member takes the allocator's lock, so it can be shared
+// between threads. on_free runs with the lock held, so a freed run can't
+// be handed out again before the hook is done with it.
+class BlockAllocator {
+  struct Summary {
+    uint pre;   // free blocks at the start of the range
+    uint suf;   // free blocks at the end of the range
+    uint best;  // longest free run inside the range
+    uint free;  // total free blocks
+    uint runs;  // number of separate free runs
+  };
+
+  const uint num_blocks;
+  mutable std::mutex lock;
+  uint num_leaves;
+  std::vector<uint64_t> bits;
+  std::vector<Summary> tree;
+  // start block -> run of shared blocks; never overlapping
+  struct SharedRun {
+    uint length;
+    uint refs;
+  };
+  std::map<uint, SharedRun> shared;
+  uint shared_count = 0;
+  // fingerprint -> block labelled with it, and the other way round
+  std::unordered_map<uint64_t, uint> by_fingerprint;
+  std::unordered_map<uint, uint64_t> fingerprints;
+  // runs freed while hold was set, in the order they were freed
+  struct HeldRun {
+    uint start;
+    uint count;
+    uint64_t tag;
+  };
+  std::deque<HeldRun> held;
+  uint held_count = 0;
+
+  static Summary summarize(uint64_t word);
+  static Summary combine(const Summary &a, const Summary &b, uint len_a, uint len_b);
+  void update(uint first_word, uint last_word);
+  void set_range(uint start, uint count, bool used);
+  bool find_run(uint count, uint *start) const;
+  bool block_free(uint block) const;
+  void reset_locked();
+  void split_shared(uint at);
+  void merge_shared(uint start, uint end);
+  void share_locked(uint start, uint count);
+  void forget_locked(uint start, uint count);
+  void release_run(uint start, uint count);
+
+ public:
+  // called with each run as it becomes free
+  std::function<void(uint start, uint count)> on_free;
+  // if set, runs that free leaves with no owner are held, tagged with
+  // what it returns (which must not decrease), until release is given a
+  // tag at least as large
+  std::function<uint64_t()> hold;
+
+  explicit BlockAllocator(uint num_blocks);
+
+  // allocate count blocks, contiguously if possible, and append the
+  // resulting (start block, length) runs to runs. Allocates nothing and
+  // returns false if there are fewer than count free blocks.
+  bool allocate(uint count, std::vector<std::pair<uint, uint>> *runs);
+  // allocate a single contiguous run
+  bool allocate_run(uint count, uint *start);
+  // mark a specific run as used, e.g. for blocks reserved by the format
+  void reserve(uint start, uint count);
+  // add an owner to every block of a used run
+  void share(uint start, uint count);
+  // drop an owner from every block of a run; blocks that had only one
+  // owner become free, or are held
+  void free(uint start, uint count);
+  // free the held runs tagged up to upto, or all of them
+  void release(uint64_t upto);
+  void release_all();
+  uint held_blocks() const;
+  uint held_extents() const;
+  // whether block has more than one owner, and through how many blocks
+  // from there that stays the same
+  bool is_shared(uint block, uint *run) const;
+  // label a used block with the fingerprint of its data, unless
+  // another block already has it
+  void set_fingerprint(uint block, uint64_t fingerprint);
+  // if a block is labelled with fingerprint, add an owner to it and set
+  // block to it
+  bool share_fingerprint(uint64_t fingerprint, uint *block);
+  // drop the labels of a run, before it is written over in place
+  void forget(uint start, uint count);
+  // number of labelled blocks
+  uint fingerprinted() const;
+  // append every shared run as (start, length, owners) to runs
+  void shared_runs(std::vector<std::pair<std::pair<uint, uint>, uint>> *runs) const;
+  // mark every block free again
+  void reset();
+  bool is_free(uint block) const;
+  // append every free run, in address order, to runs, then the held
+  // runs too if with_held is set
+  void free_runs(std::vector<std::pair<uint, uint>> *runs,
+                 bool with_held = false) const;
+
+  uint total_blocks() const { return num_blocks; }
+  uint free_blocks() const;
+  uint largest_free_run() const;
+  uint free_extents() const;
+  uint shared_blocks() const;
+  // share of free space not in the largest run: 0 when all free space
+  // is contiguous, approaching 1 as it splinters
+  double fragmentation() const;
+};
+
+#endif /* _ALLOCATOR_H_ */
@@ -0,0 +1,506 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "toyfs.hpp"
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::fixed;
+using std::istringstream;
+using std::max;
+using std::min;
+using std::mt19937;
+using std::ofstream;
+using std::ostream;
+using std::setprecision;
+using std::stoi;
+using std::string;
+using std::thread;
+using std::to_string;
+using std::uniform_int_distribution;
+using std::vector;
+
+const uint DISKSIZE = 100000000;
+const uint CACHEBLOCKS = 1024;
+// bytes per read or write call in the sequential benchmarks
+const uint CHUNK = 64 * 1024;
+// largest file the sequential, cp and import/export benchmarks use
+const uint LARGE_FILE = 16 << 20;
+const uint LOOKUPS = 20000;
+const uint CHURN = 20000;
+const uint APPENDS = 20000;
+const uint APPEND_SIZE = 64;
+const uint COPIES = 500;
+const uint TRANSFERS = 16;
+const uint FRAG_CYCLES = 2000;
+const uint FRAG_FILES = 256;
+// rounds per thread in the mixed benchmark; each is six operations
+const uint ROUNDS = 200;
+
+// what a benchmark run measured: per-operation latencies and the total
+// time spent in timed sections
+struct BenchResult {
+  string name;
+  string param;
+  uint block_size;
+  uint direct_blocks;
+  vector<double> latencies;
+  uint64_t bytes = 0;
+  double seconds = 0;
+};
+
+struct Config {
+  string filename;
+  StorageMode mode;
+  uint block_size;
+  uint direct_blocks;
+  // largest file the image's inodes can hold
+  uint max_file;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+template <class F>
+double elapsed(F op) {
+  auto start = Clock::now();
+  op();
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// run one operation, recording its latency and the bytes it moved
+template <class F>
+void timed(BenchResult *result, uint64_t bytes, F op) {
+  double seconds = elapsed(op);
+  result->latencies.push_back(seconds);
+  result->seconds += seconds;
+  result->bytes += bytes;
+}
+
+BenchResult make_result(const Config &config, const string &name,
+                   const string &param) {
+  BenchResult result;
+  result.name = name;
+  result.param = param;
+  result.block_size = config.block_size;
+  result.direct_blocks = config.direct_blocks;
+  return result;
+}
+
+// a benchmark is meaningless if its operations fail, so stop
+void check(FsError error, const string &what) {
+  if (error != FS_OK) {
+    cerr << "bench: error: " << what << ": " << fs_strerror(error) << endl;
+    exit(1);
+  }
+}
+
+template <typename T>
+T check(Result<T> result, const string &what) {
+  check(result.error(), what);
+  return *result;
+}
+
+// write size bytes to a new file, CHUNK at a time
+void write_file(ToyFS &fs, const string &path, uint size,
+                BenchResult *result = nullptr) {
+  uint fd = check(fs.open(path, ToyFS::W), path);
+  vector<char> chunk(min(size, CHUNK), 'x');
+  for (uint done = 0; done < size; done += chunk.size()) {
+    uint n = min<uint>(chunk.size(), size - done);
+    auto write = [&] () {check(fs.write(fd, chunk.data(), n), path);};
+    if (result == nullptr) {
+      write();
+    } else {
+      timed(result, n, write);
+    }
+  }
+  if (result == nullptr) {
+    check(fs.close(fd), path);
+  } else {
+    // the close commits, which is where the data reaches the disk
+    result->seconds += elapsed([&] () {check(fs.close(fd), path);});
+  }
+}
+
+void make_host_file(const string &path, uint size) {
+  ofstream out(path, ofstream::binary);
+  for (uint i = 0; i < size; ++i) {
+    out.put('a' + i % 26);
+  }
+}
+
+// stat files at the bottom of a chain of depth directories
+BenchResult bench_depth(ToyFS &fs, const Config &config, uint depth) {
+  BenchResult result = make_result(config, "lookup_depth",
+                              "depth=" + to_string(depth));
+  string dir;
+  for (uint i = 0; i < depth; ++i) {
+    dir += "/d" + to_string(i);
+    check(fs.mkdir(dir), dir);
+  }
+  // links to one file in the root, since link wants two directories
+  write_file(fs, "/leaf", 1);
+  const uint leaves = 64;
+  for (uint i = 0; i < leaves; ++i) {
+    check(fs.link("/leaf", dir + "/f" + to_string(i)), "link");
+  }
+
+  mt19937 random(depth);
+  uniform_int_distribution<uint> pick(0, leaves - 1);
+  for (uint i = 0; i < LOOKUPS; ++i) {
+    string path = dir + "/f" + to_string(pick(random));
+    timed(&result, 0, [&] () {check(fs.stat(path), path);});
+  }
+  return result;
+}
+
+// stat random files in a directory holding fanout of them
+BenchResult bench_fanout(ToyFS &fs, const Config &config, uint fanout) {
+  BenchResult result = make_result(config, "lookup_fanout",
+                              "entries=" + to_string(fanout));
+  check(fs.mkdir("/wide"), "/wide");
+  write_file(fs, "/leaf", 1);
+  for (uint i = 0; i < fanout; ++i) {
+    check(fs.link("/leaf", "/wide/f" + to_string(i)), "link");
+  }
+
+  mt19937 random(fanout);
+  uniform_int_distribution<uint> pick(0, fanout - 1);
+  for (uint i = 0; i < LOOKUPS; ++i) {
+    string path = "/wide/f" + to_string(pick(random));
+    timed(&result, 0, [&] () {check(fs.stat(path), path);});
+  }
+  return result;
+}
+
+// open and close the same file over and over
+BenchResult bench_churn(ToyFS &fs, const Config &config, uint) {
+  BenchResult result = make_result(config, "open_close", "");
+  write_file(fs, "/churn", 1);
+  for (uint i = 0; i < CHURN; ++i) {
+    timed(&result, 0, [&] () {
+      uint fd = check(fs.open("/churn", ToyFS::R), "/churn");
+      check(fs.close(fd), "/churn");
+    });
+  }
+  return result;
+}
+
+// many small writes to one open file
+BenchResult bench_append(ToyFS &fs, const Config &config, uint) {
+  BenchResult result = make_result(config, "small_append",
+                              "bytes=" + to_string(APPEND_SIZE));
+  uint count = min(APPENDS, config.max_file / APPEND_SIZE);
+  uint fd = check(fs.open("/log", ToyFS::W), "/log");
+  string record(APPEND_SIZE, 'x');
+  for (uint i = 0; i < count; ++i) {
+    timed(&result, APPEND_SIZE, [&] () {
+      check(fs.write(fd, record.data(), record.size()), "/log");
+    });
+  }
+  result.seconds += elapsed([&] () {check(fs.close(fd), "/log");});
+  return result;
+}
+
+BenchResult bench_seq_write(ToyFS &fs, const Config &config, uint) {
+  uint size = min(LARGE_FILE, config.max_file);
+  BenchResult result = make_result(config, "seq_write",
+                              "file=" + to_string(size));
+  for (uint i = 0; i < 4; ++i) {
+    write_file(fs, "/seq" + to_string(i), size, &result);
+  }
+  return result;
+}
+
+BenchResult bench_seq_read(ToyFS &fs, const Config &config, uint) {
+  uint size = min(LARGE_FILE, config.max_file);
+  BenchResult result = make_result(config, "seq_read",
+                                   "file=" + to_string(size));
+  for (uint i = 0; i < 4; ++i) {
+    write_file(fs, "/seq" + to_string(i), size);
+  }
+  vector<char> buf(CHUNK);
+  for (uint i = 0; i < 4; ++i) {
+    string path = "/seq" + to_string(i);
+    uint fd = check(fs.open(path, ToyFS::R), path);
+    for (uint done = 0; done < size; done += CHUNK) {
+      uint n = min(CHUNK, size - done);
+      timed(&result, n, [&] () {check(fs.read(fd, buf.data(), n), path);});
+    }
+    check(fs.close(fd), path);
+  }
+  return result;
+}
+
+// copies share blocks, so this mostly measures the metadata work
+BenchResult bench_cp(ToyFS &fs, const Config &config, uint) {
+  uint size = min(1u << 20, config.max_file);
+  BenchResult result = make_result(config, "cp", "file=" + to_string(size));
+  write_file(fs, "/original", size);
+  for (uint i = 0; i < COPIES; ++i) {
+    string copy = "/copy" + to_string(i);
+    timed(&result, size, [&] () {check(fs.cp("/original", copy), copy);});
+  }
+  return result;
+}
+
+BenchResult bench_import(ToyFS &fs, const Config &config, uint) {
+  uint size = min(4u << 20, config.max_file);
+  BenchResult result = make_result(config, "import", "file=" + to_string(size));
+  string host_file = config.filename + ".bench-in";
+  make_host_file(host_file, size);
+  for (uint i = 0; i < TRANSFERS; ++i) {
+    string path = "/in" + to_string(i);
+    timed(&result, size, [&] () {check(fs.import(host_file, path), path);});
+  }
+  std::remove(host_file.c_str());
+  return result;
+}
+
+BenchResult bench_export(ToyFS &fs, const Config &config, uint) {
+  uint size = min(4u << 20, config.max_file);
+  BenchResult result = make_result(config, "export", "file=" + to_string(size));
+  string host_file = config.filename + ".bench-out";
+  write_file(fs, "/out", size);
+  for (uint i = 0; i < TRANSFERS; ++i) {
+    timed(&result, size, [&] () {
+      check(fs.export_file("/out", host_file), host_file);
+    });
+  }
+  std::remove(host_file.c_str());
+  return result;
+}
+
+// keep a pool of files of random sizes, replacing a random one each
+// cycle, so the free space ends up in many small pieces
+BenchResult bench_frag(ToyFS &fs, const Config &config, uint) {
+  BenchResult result = make_result(config, "frag_cycle",
+                              "files=" + to_string(FRAG_FILES));
+  uint max_blocks = max(1u, min(32u, config.max_file / config.block_size));
+  mt19937 random(FRAG_FILES);
+  uniform_int_distribution<uint> pick(0, FRAG_FILES - 1);
+  uniform_int_distribution<uint> blocks(1, max_blocks);
+  vector<bool> present(FRAG_FILES);
+  for (uint i = 0; i < FRAG_CYCLES; ++i) {
+    uint slot = pick(random);
+    string path = "/frag" + to_string(slot);
+    uint size = blocks(random) * config.block_size;
+    timed(&result, size, [&] () {
+      if (present[slot]) {
+        check(fs.unlink(path), path);
+      }
+      write_file(fs, path, size);
+    });
+    present[slot] = true;
+  }
+  return result;
+}
+
+// read a whole file, as cat does
+void read_file(ToyFS &fs, const string &path, vector<char> *buf) {
+  uint fd = check(fs.open(path, ToyFS::R), path);
+  buf->resize(check(fs.fstat(fd), path).size);
+  check(fs.read(fd, buf->data(), buf->size()), path);
+  check(fs.close(fd), path);
+}
+
+// one thread of the mixed benchmark: import, read back, copy, stat and
+// delete files in a directory of its own
+void mixed_worker(ToyFS *fs, uint id, const string &host_file,
+                  vector<double> *latencies) {
+  string dir = "/t" + to_string(id);
+  check(fs->mkdir(dir), dir);
+  vector<char> buf;
+  auto op = [&] (std::function<void()> run) {
+    latencies->push_back(elapsed(run));
+  };
+  for (uint i = 0; i < ROUNDS; ++i) {
+    string name = dir + "/f" + to_string(i);
+    string copy = dir + "/c" + to_string(i);
+    op([&] () {check(fs->import(host_file, name), name);});
+    op([&] () {read_file(*fs, name, &buf);});
+    op([&] () {check(fs->cp(name, copy), copy);});
+    op([&] () {check(fs->stat(copy), copy);});
+    op([&] () {check(fs->unlink(name), name);});
+    op([&] () {check(fs->unlink(copy), copy);});
+  }
+}
+
+// the mixed workload on threads threads against one image; seconds is
+// wall time, so ops/s across thread counts shows the scaling
+BenchResult bench_mixed(const Config &config, uint threads) {
+  BenchResult result = make_result(config, "mixed",
+                                   "threads=" + to_string(threads));
+  string host_file = config.filename + ".bench-in";
+  make_host_file(host_file, 64 * 1024);
+  ToyFS fs(config.filename, DISKSIZE, config.block_size, config.direct_blocks,
+           CACHEBLOCKS, config.mode, true, true);
+  vector<vector<double>> latencies(threads);
+  result.seconds = elapsed([&] () {
+    vector<thread> workers;
+    for (uint id = 0; id < threads; ++id) {
+      workers.push_back(
+          thread(mixed_worker, &fs, id, host_file, &latencies[id]));
+    }
+    for (auto &t : workers) {
+      t.join();
+    }
+  });
+  for (auto &l : latencies) {
+    result.latencies.insert(result.latencies.end(), l.begin(), l.end());
+  }
+  std::remove(host_file.c_str());
+  return result;
+}
+
+void print_header(ostream &out) {
+  out << "benchmark,param,block_size,direct_blocks,ops,seconds,ops_per_sec,"
+         "mb_per_sec,p50_us,p90_us,p99_us,max_us" << endl;
+}
+
+// one CSV line; mb_per_sec is left empty for operations that move no
+// data
+void print_result(ostream &out, BenchResult &result) {
+  auto &l = result.latencies;
+  std::sort(l.begin(), l.end());
+  auto percentile = [&] (double p) {
+    return l.empty() ? 0 : l[min<size_t>(l.size() - 1, p * l.size())] * 1e6;
+  };
+  double seconds = max(result.seconds, 1e-9);
+  out << result.name << "," << result.param << "," << result.block_size << ","
+      << result.direct_blocks << "," << l.size() << "," << fixed
+      << setprecision(6) << result.seconds << "," << setprecision(1)
+      << l.size() / seconds << ",";
+  if (result.bytes > 0) {
+    out << setprecision(2) << result.bytes / seconds / (1 << 20);
+  }
+  out << setprecision(1) << "," << percentile(0.5) << "," << percentile(0.9)
+      << "," << percentile(0.99) << "," << percentile(1.0) << endl;
+}
+
+// the benchmarks that run alone on a fresh image, once per parameter
+struct Benchmark {
+  string name;
+  BenchResult (*run)(ToyFS &, const Config &, uint);
+  vector<uint> params;
+};
+
+const vector<Benchmark> BENCHMARKS = {
+  {"lookup_depth", bench_depth, {1, 8, 32, 128}},
+  {"lookup_fanout", bench_fanout, {16, 1024, 16384}},
+  {"open_close", bench_churn, {0}},
+  {"small_append", bench_append, {0}},
+  {"seq_write", bench_seq_write, {0}},
+  {"seq_read", bench_seq_read, {0}},
+  {"cp", bench_cp, {0}},
+  {"import", bench_import, {0}},
+  {"export", bench_export, {0}},
+  {"frag_cycle", bench_frag, {0}},
+};
+
+vector<uint> parse_list(const string &text) {
+  vector<uint> values;
+  istringstream in(text);
+  string item;
+  while (getline(in, item, ',')) {
+    values.push_back(stoi(item));
+  }
+  return values;
+}
+
+void usage(const char *program) {
+  cerr << "usage: " << program << " [-m] [-b block_sizes] [-d direct_blocks]"
+       << " [-t max_threads] filename [benchmark...]" << endl;
+  cerr << "benchmarks:";
+  for (auto &b : BENCHMARKS) {
+    cerr << " " << b.name;
+  }
+  cerr << " mixed" << endl;
+}
+
+// run each selected benchmark on a fresh image for every combination of
+// block size and direct block count, and print one CSV line per run
+int main(int argc, char **argv) {
+  StorageMode mode = file_mode;
+  vector<uint> block_sizes = {1024};
+  vector<uint> direct_counts = {100};
+  uint max_threads = thread::hardware_concurrency();
+  int arg = 1;
+  for (; arg < argc && argv[arg][0] == '-'; ++arg) {
+    string flag(argv[arg]);
+    if (flag == "-m") {
+      mode = mmap_mode;
+    } else if (arg + 1 < argc && flag == "-b") {
+      block_sizes = parse_list(argv[++arg]);
+    } else if (arg + 1 < argc && flag == "-d") {
+      direct_counts = parse_list(argv[++arg]);
+    } else if (arg + 1 < argc && flag == "-t") {
+      max_threads = stoi(argv[++arg]);
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (arg >= argc) {
+    usage(argv[0]);
+    return 1;
+  }
+  string filename(argv[arg++]);
+  vector<string> selected(argv + arg, argv + argc);
+  for (auto &name : selected) {
+    bool known = name == "mixed";
+    for (auto &b : BENCHMARKS) {
+      known = known || b.name == name;
+    }
+    if (!known) {
+      cerr << "bench: error: unknown benchmark " << name << endl;
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  auto wanted = [&] (const string &name) {
+    return selected.empty() ||
+           std::find(selected.begin(), selected.end(), name) != selected.end();
+  };
+  max_threads = max(1u, max_threads);
+
+  print_header(cout);
+  for (uint block_size : block_sizes) {
+    for (uint direct_blocks : direct_counts) {
+      uint max_file = block_size * (direct_blocks + direct_blocks * direct_blocks);
+      Config config{filename, mode, block_size, direct_blocks, max_file};
+      for (auto &b : BENCHMARKS) {
+        if (!wanted(b.name)) {
+          continue;
+        }
+        for (uint param : b.params) {
+          BenchResult result;
+          {
+            ToyFS fs(filename, DISKSIZE, block_size, direct_blocks,
+                     CACHEBLOCKS, mode, true);
+            result = b.run(fs, config, param);
+          }
+          print_result(cout, result);
+        }
+      }
+      if (wanted("mixed")) {
+        for (uint threads = 1; threads <= max_threads; ++threads) {
+          BenchResult result = bench_mixed(config, threads);
+          print_result(cout, result);
+        }
+      }
+    }
+  }
+  return 0;
+}
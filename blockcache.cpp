@@ -0,0 +1,404 @@
+#include "blockcache.hpp"
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <utility>
+#include "metrics.hpp"
+
+using std::function;
+using std::lock_guard;
+using std::min;
+using std::mutex;
+using std::pair;
+using std::prev;
+using std::sort;
+using std::unique_lock;
+using std::vector;
+
+// requests covering more blocks than this bypass the cache
+const uint STREAM_BLOCKS = 32;
+
+BlockCache::BlockCache(Storage &disk, uint block_size, uint capacity,
+                       IOEngine *engine)
+    : disk(disk), engine(engine), block_size(block_size), capacity(capacity) {}
+
+BlockCache::Entry *BlockCache::lookup(uint block) {
+  auto it = index.find(block);
+  if (it == index.end()) {
+    return nullptr;
+  }
+  ++hits;
+  lru.splice(lru.begin(), lru, it->second);
+  return &lru.front();
+}
+
+// make an entry for a block that is not cached; its data is garbage
+BlockCache::Entry &BlockCache::insert(uint block) {
+  if (lru.size() >= capacity) {
+    // reuse the least recently used entry's buffer
+    Entry &victim = lru.back();
+    write_back(victim);
+    index.erase(victim.block);
+    lru.splice(lru.begin(), lru, prev(lru.end()));
+  } else {
+    lru.push_front(Entry{0, false, vector<char>(block_size)});
+  }
+
+  Entry &entry = lru.front();
+  entry.block = block;
+  entry.dirty = false;
+  index[block] = lru.begin();
+  return entry;
+}
+
+// return the cached copy of block, reading it from disk if load is set
+// (callers about to overwrite the whole block don't need the old data)
+BlockCache::Entry &BlockCache::get(uint block, bool load) {
+  Entry *entry = lookup(block);
+  if (entry != nullptr) {
+    return *entry;
+  }
+  ++misses;
+  Entry &fresh = insert(block);
+  if (load) {
+    note_request(block * block_size, block_size);
+    disk.read(block * block_size, fresh.data.data(), block_size);
+  }
+  return fresh;
+}
+
+void BlockCache::write_back(Entry &entry) {
+  if (!entry.dirty) {
+    return;
+  }
+  note_request(entry.block * block_size, block_size);
+  disk.write(entry.block * block_size, entry.data.data(), block_size);
+  entry.dirty = false;
+  ++writebacks;
+}
+
+bool BlockCache::streaming(uint addr, uint len) const {
+  uint blocks = (addr + len - 1) / block_size - addr / block_size + 1;
+  // never let one request fill more than half the cache, so the entries
+  // it inserts can't evict each other
+  return blocks > min(STREAM_BLOCKS, capacity / 2);
+}
+
+// read one range with the lock held; streamed runs are appended to
+// streamed for the caller to transfer once the lock is dropped
+void BlockCache::read_segment(uint addr, char *buf, uint len,
+                              vector<IORequest> *streamed) {
+  bool stream = streaming(addr, len);
+  // a run of whole uncached blocks waiting to be read in one request
+  uint run_addr = 0;
+  uint run_len = 0;
+  char *run_buf = nullptr;
+  vector<iovec> run_iov;
+  vector<pair<Entry *, char *>> run_copies;
+  auto read_run = [&] () {
+    if (run_len == 0) {
+      return;
+    }
+    if (stream) {
+      streamed->push_back(IORequest{false, run_addr, run_buf, run_len});
+    } else {
+      note_request(run_addr, run_len);
+      disk.readv(run_addr, run_iov);
+      for (auto &copy : run_copies) {
+        memcpy(copy.second, copy.first->data.data(), block_size);
+      }
+    }
+    run_len = 0;
+    run_iov.clear();
+    run_copies.clear();
+  };
+
+  while (len > 0) {
+    uint block = addr / block_size;
+    uint offset = addr % block_size;
+    uint n = min(len, block_size - offset);
+    Entry *entry = lookup(block);
+    if (entry != nullptr) {
+      read_run();
+      memcpy(buf, entry->data.data() + offset, n);
+    } else if (n < block_size) {
+      read_run();
+      memcpy(buf, get(block, true).data.data() + offset, n);
+    } else {
+      if (run_len == 0) {
+        run_addr = addr;
+        run_buf = buf;
+      }
+      run_len += n;
+      ++misses;
+      if (!stream) {
+        Entry &fresh = insert(block);
+        run_iov.push_back(iovec{fresh.data.data(), block_size});
+        run_copies.push_back(std::make_pair(&fresh, buf));
+      }
+    }
+    addr += n;
+    buf += n;
+    len -= n;
+  }
+  read_run();
+}
+
+void BlockCache::write_segment(uint addr, const char *buf, uint len,
+                               vector<IORequest> *streamed) {
+  bool stream = streaming(addr, len);
+  // a run of whole uncached blocks waiting to be written in one request
+  uint run_addr = 0;
+  uint run_len = 0;
+  const char *run_buf = nullptr;
+  auto write_run = [&] () {
+    if (run_len > 0) {
+      // the request only reads from the buffer
+      streamed->push_back(IORequest{true, run_addr,
+                                    const_cast<char *>(run_buf), run_len});
+      run_len = 0;
+    }
+  };
+
+  while (len > 0) {
+    uint block = addr / block_size;
+    uint offset = addr % block_size;
+    uint n = min(len, block_size - offset);
+    Entry *entry = lookup(block);
+    if (entry == nullptr && stream && n == block_size) {
+      if (run_len == 0) {
+        run_addr = addr;
+        run_buf = buf;
+      }
+      run_len += n;
+      ++misses;
+    } else {
+      write_run();
+      if (entry == nullptr) {
+        entry = &get(block, n < block_size);
+      }
+      memcpy(entry->data.data() + offset, buf, n);
+      entry->dirty = true;
+    }
+    addr += n;
+    buf += n;
+    len -= n;
+  }
+  write_run();
+}
+
+void BlockCache::read(uint addr, char *buf, uint len) {
+  read(vector<Segment>{Segment{addr, buf, len}});
+}
+
+void BlockCache::write(uint addr, const char *buf, uint len) {
+  write(vector<Segment>{Segment{addr, const_cast<char *>(buf), len}});
+}
+
+void BlockCache::read(const vector<Segment> &segments) {
+  transfer(stream(segments, false));
+}
+
+void BlockCache::write(const vector<Segment> &segments) {
+  transfer(stream(segments, true));
+}
+
+void BlockCache::read(const vector<Segment> &segments, function<void()> done) {
+  auto streamed = stream(segments, false);
+  if (engine == nullptr || streamed.empty()) {
+    transfer(std::move(streamed));
+    done();
+    return;
+  }
+  engine->submit(std::move(streamed), std::move(done));
+}
+
+void BlockCache::write(const vector<Segment> &segments, function<void()> done) {
+  vector<IORequest> streamed, partial;
+  for (auto &request : stream(segments, true)) {
+    bool whole = request.addr % block_size == 0 &&
+        request.len % block_size == 0;
+    (whole ? streamed : partial).push_back(request);
+  }
+  transfer(std::move(partial));
+  if (engine == nullptr || streamed.empty()) {
+    transfer(std::move(streamed));
+    done();
+    return;
+  }
+  {
+    lock_guard<mutex> guard(flight_lock);
+    ++writes_in_flight;
+  }
+  engine->submit(std::move(streamed), [this, done] () {
+    {
+      lock_guard<mutex> guard(flight_lock);
+      if (--writes_in_flight == 0) {
+        landed.notify_all();
+      }
+    }
+    done();
+  });
+}
+
+// copy what the cache can of each segment, and return the runs that go
+// straight to the disk
+vector<IORequest> BlockCache::stream(const vector<Segment> &segments,
+                                     bool write) {
+  vector<IORequest> streamed;
+  if (capacity == 0) {
+    for (auto &segment : segments) {
+      streamed.push_back(IORequest{write, segment.addr, segment.buf,
+                                   segment.len});
+    }
+  } else {
+    lock_guard<mutex> guard(lock);
+    for (auto &segment : segments) {
+      if (write) {
+        write_segment(segment.addr, segment.buf, segment.len, &streamed);
+      } else {
+        read_segment(segment.addr, segment.buf, segment.len, &streamed);
+      }
+    }
+  }
+  for (auto &request : streamed) {
+    note_request(request.addr, request.len);
+  }
+  return streamed;
+}
+
+// move streamed runs between the disk and the callers' buffers, all at
+// once if we have an engine
+void BlockCache::transfer(vector<IORequest> requests) {
+  if (engine != nullptr && requests.size() > 1) {
+    engine->run(std::move(requests));
+    return;
+  }
+  for (auto &request : requests) {
+    if (request.write) {
+      disk.write(request.addr, request.buf, request.len);
+    } else {
+      disk.read(request.addr, request.buf, request.len);
+    }
+  }
+}
+
+// a request that doesn't start where the last one ended is a seek
+void BlockCache::note_request(uint addr, uint len) {
+  if (next_addr.exchange(addr + len) != addr) {
+    Metrics::count(Metrics::SEEKS, 1);
+  }
+}
+
+void BlockCache::prefetch(const vector<pair<uint, uint>> &runs) {
+  if (capacity == 0) {
+    return;
+  }
+  lock_guard<mutex> guard(lock);
+  // like a request, never fill more than half the cache, so the blocks
+  // we insert can't evict each other
+  uint budget = capacity / 2;
+  uint run_start = 0;
+  vector<iovec> run_iov;
+  auto read_run = [&] () {
+    if (!run_iov.empty()) {
+      note_request(run_start * block_size, run_iov.size() * block_size);
+      disk.readv(run_start * block_size, run_iov);
+      prefetched += run_iov.size();
+      run_iov.clear();
+    }
+  };
+
+  for (auto &run : runs) {
+    for (uint block = run.first; block < run.first + run.second && budget > 0;
+         ++block, --budget) {
+      if (index.count(block) > 0) {
+        read_run();
+        continue;
+      }
+      if (run_iov.empty()) {
+        run_start = block;
+      }
+      run_iov.push_back(iovec{insert(block).data.data(), block_size});
+    }
+    read_run();
+  }
+}
+
+void BlockCache::wait_for_writes() {
+  unique_lock<mutex> guard(flight_lock);
+  landed.wait(guard, [this] () {return writes_in_flight == 0;});
+}
+
+void BlockCache::flush() {
+  wait_for_writes();
+  lock_guard<mutex> guard(lock);
+  // write back in disk order, one request per run of adjacent blocks
+  vector<Entry *> dirty_entries;
+  for (auto &entry : lru) {
+    if (entry.dirty) {
+      dirty_entries.push_back(&entry);
+    }
+  }
+  sort(begin(dirty_entries), end(dirty_entries),
+       [] (const Entry *a, const Entry *b) {return a->block < b->block;});
+
+  vector<iovec> run_iov;
+  for (size_t i = 0; i < dirty_entries.size(); ++i) {
+    Entry *entry = dirty_entries[i];
+    run_iov.push_back(iovec{entry->data.data(), block_size});
+    entry->dirty = false;
+    ++writebacks;
+    bool run_ends = i + 1 == dirty_entries.size() ||
+        dirty_entries[i + 1]->block != entry->block + 1;
+    if (run_ends) {
+      uint first = entry->block + 1 - run_iov.size();
+      note_request(first * block_size, run_iov.size() * block_size);
+      disk.writev(first * block_size, run_iov);
+      run_iov.clear();
+    }
+  }
+}
+
+void BlockCache::discard(uint start, uint count) {
+  lock_guard<mutex> guard(lock);
+  auto drop = [&] (std::list<Entry>::iterator it) {
+    index.erase(it->block);
+    lru.erase(it);
+  };
+  if (count < lru.size()) {
+    for (uint block = start; block < start + count; ++block) {
+      auto it = index.find(block);
+      if (it != index.end()) {
+        drop(it->second);
+      }
+    }
+  } else {
+    for (auto it = lru.begin(); it != lru.end();) {
+      auto next_it = std::next(it);
+      if (it->block >= start && it->block < start + count) {
+        drop(it);
+      }
+      it = next_it;
+    }
+  }
+}
+
+void BlockCache::sync() {
+  flush();
+  disk.sync();
+}
+
+uint BlockCache::size() const {
+  lock_guard<mutex> guard(lock);
+  return lru.size();
+}
+
+uint BlockCache::dirty() const {
+  lock_guard<mutex> guard(lock);
+  uint count = 0;
+  for (auto &entry : lru) {
+    count += entry.dirty;
+  }
+  return count;
+}
@@ -0,0 +1,114 @@
+#ifndef _BLOCKCACHE_H_
+#define _BLOCKCACHE_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <sys/types.h>
+#include "ioengine.hpp"
+#include "storage.hpp"
+
+// Write-back LRU cache of disk blocks. All block I/O goes through read
+// and write; dirty blocks reach the disk when they are evicted or on
+// flush. With a capacity of 0 it passes everything straight through.
+//
+// Runs of whole blocks that miss the cache are transferred with a single
+// disk request. Requests too large to be worth caching stream straight
+// between the caller's buffer and the disk; given an IOEngine, all the
+// streamed runs of a request go to the disk as one batch, which can also
+// be left to finish in the background.
+//
+// The cache is safe to share between threads. Streamed transfers happen
+// after the lock is dropped, so callers must not read or write the same
+// blocks from two threads at once (ToyFS holds the owning inode's lock).
+class BlockCache {
+ public:
+  // a range of bytes on disk and the buffer it is copied to or from;
+  // writes only read from buf
+  struct Segment {
+    uint addr;
+    char *buf;
+    uint len;
+  };
+
+ private:
+  struct Entry {
+    uint block;
+    bool dirty;
+    std::vector<char> data;
+  };
+
+  Storage &disk;
+  IOEngine *engine;
+  const uint block_size;
+  const uint capacity;
+  mutable std::mutex lock;
+  std::list<Entry> lru;
+  std::unordered_map<uint, std::list<Entry>::iterator> index;
+  // where the last disk request ended, to tell which ones seek
+  std::atomic<uint> next_addr{0};
+  // batches of writes handed to the engine that haven't finished yet
+  std::mutex flight_lock;
+  std::condition_variable landed;
+  uint writes_in_flight = 0;
+
+  Entry *lookup(uint block);
+  Entry &insert(uint block);
+  Entry &get(uint block, bool load);
+  void write_back(Entry &entry);
+  bool streaming(uint addr, uint len) const;
+  void read_segment(uint addr, char *buf, uint len,
+                    std::vector<IORequest> *streamed);
+  void write_segment(uint addr, const char *buf, uint len,
+                     std::vector<IORequest> *streamed);
+  std::vector<IORequest> stream(const std::vector<Segment> &segments,
+                                bool write);
+  void transfer(std::vector<IORequest> requests);
+  void wait_for_writes();
+  void note_request(uint addr, uint len);
+
+ public:
+  std::atomic<uint> hits{0};
+  std::atomic<uint> misses{0};
+  std::atomic<uint> writebacks{0};
+  std::atomic<uint> prefetched{0};
+
+  BlockCache(Storage &disk, uint block_size, uint capacity,
+             IOEngine *engine = nullptr);
+
+  // copy len bytes at byte address addr on disk; the range may span
+  // several consecutive blocks
+  void read(uint addr, char *buf, uint len);
+  void write(uint addr, const char *buf, uint len);
+  // the same for several ranges at once, e.g. every extent a file
+  // request touches
+  void read(const std::vector<Segment> &segments);
+  void write(const std::vector<Segment> &segments);
+  // the same, but the streamed runs are handed to the engine and done
+  // is called on an engine thread once they have finished; without an
+  // engine, or with nothing to stream, done is called before returning.
+  // Writes of part of a block are finished before returning, so the
+  // block can be read back at once.
+  void read(const std::vector<Segment> &segments, std::function<void()> done);
+  void write(const std::vector<Segment> &segments, std::function<void()> done);
+  // read the uncached blocks of each (start block, count) run into the
+  // cache ahead of a reader, a disk request per run of them; at most
+  // half the cache is filled
+  void prefetch(const std::vector<std::pair<uint, uint>> &runs);
+  // write every dirty block back to the disk, once the writes still in
+  // flight have finished
+  void flush();
+  // flush and make the disk durable
+  void sync();
+  // drop count blocks from start without writing them back
+  void discard(uint start, uint count);
+  uint size() const;
+  uint dirty() const;
+};
+
+#endif /* _BLOCKCACHE_H_ */
@@ -1,24 +1,33 @@
 #include "direntry.hpp"
-#include <algorithm>
+#include <iterator>
 #include <sstream>
 #include <vector>
 
 
-using std::find_if;
 using std::istringstream;
+using std::lock_guard;
 using std::make_shared;
+using std::mutex;
+using std::prev;
 using std::shared_ptr;
 using std::string;
 using std::vector;
 using std::weak_ptr;
 
 DirEntry::DirEntry() {
+  removed = false;
   is_locked = false;
 }
 
+DirEntry::~DirEntry() {
+  if (inode != nullptr) {
+    --inode->links;
+  }
+}
+
 shared_ptr<DirEntry> DirEntry::make_de_dir(const string name,
                                            const shared_ptr<DirEntry> parent) {
-  auto sp = make_shared<DirEntry>(DirEntry());
+  shared_ptr<DirEntry> sp(new DirEntry());
   if (parent == nullptr) {
     sp->parent = sp;
   } else {
@@ -34,7 +43,7 @@ shared_ptr<DirEntry> DirEntry::make_de_dir(const string name,
 shared_ptr<DirEntry> DirEntry::make_de_file(const string name,
                                             const shared_ptr<DirEntry> parent,
                                             const shared_ptr<Inode> &inode) {
-  auto sp = make_shared<DirEntry>(DirEntry());
+  shared_ptr<DirEntry> sp(new DirEntry());
   if (parent == nullptr) {
     sp->parent = sp;
   } else {
@@ -44,6 +53,9 @@ shared_ptr<DirEntry> DirEntry::make_de_file(const string name,
   sp->self = sp;
   sp->name = name;
   sp->inode = inode;
+  if (inode != nullptr) {
+    ++inode->links;
+  }
   return sp;
 }
 
@@ -55,24 +67,57 @@ shared_ptr<DirEntry> DirEntry::find_child(const string name) const {
     return self.lock();
   }
 
-  // search through contents and return ptr if found, otherwise nullptr
-  auto named = [&] (const shared_ptr<DirEntry> de) {return de->name == name;};
-  auto it = find_if(begin(contents), end(contents), named);
-  if (it == end(contents)) {
+  // look the name up in the index and return ptr if found, otherwise nullptr
+  lock_guard<mutex> guard(lock);
+  auto it = index.find(name);
+  if (it == end(index)) {
     return nullptr;
   }
 
-  return *it;
+  return *(it->second);
 }
 
 shared_ptr<DirEntry> DirEntry::add_dir(const string name) {
   auto new_dir = make_de_dir(name, self.lock());
-  contents.push_back(new_dir);
-  return new_dir;
+  return add_entry(new_dir) ? new_dir : nullptr;
 }
 
 shared_ptr<DirEntry> DirEntry::add_file(const string name) {
   auto new_file = make_de_file(name, self.lock(), make_shared<Inode>());
-  contents.push_back(new_file);
-  return new_file;
+  return add_entry(new_file) ? new_file : nullptr;
+}
+
+bool DirEntry::add_entry(const shared_ptr<DirEntry> entry) {
+  lock_guard<mutex> guard(lock);
+  if (removed || index.count(entry->name) > 0) {
+    return false;
+  }
+  contents.push_back(entry);
+  index[entry->name] = prev(end(contents));
+  return true;
+}
+
+bool DirEntry::remove_child(const string name) {
+  lock_guard<mutex> guard(lock);
+  auto it = index.find(name);
+  if (it == end(index)) {
+    return false;
+  }
+  contents.erase(it->second);
+  index.erase(it);
+  return true;
+}
+
+bool DirEntry::remove_if_empty() {
+  lock_guard<mutex> guard(lock);
+  if (!contents.empty()) {
+    return false;
+  }
+  removed = true;
+  return true;
+}
+
+vector<shared_ptr<DirEntry>> DirEntry::entries() const {
+  lock_guard<mutex> guard(lock);
+  return vector<shared_ptr<DirEntry>>(begin(contents), end(contents));
 }
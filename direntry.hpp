@@ -1,35 +1,59 @@
 #ifndef _DIRENTRY_H_
 #define _DIRENTRY_H_
 
+#include <atomic>
 #include <list>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
+#include <unordered_map>
 #include <sys/types.h>
-#include "freenode.hpp"
 #include "inode.hpp"
 
 enum EntryType { file, dir };
 
 class DirEntry: public std::enable_shared_from_this<DirEntry> {
   DirEntry();
+  // name -> position in contents, so lookups don't walk the list
+  std::unordered_map<std::string,
+                     std::list<std::shared_ptr<DirEntry>>::iterator> index;
  public:
   static std::shared_ptr<DirEntry> make_de_dir(const std::string name,
                                                const std::shared_ptr<DirEntry> parent);
   static std::shared_ptr<DirEntry> make_de_file(const std::string name,
                                                 const std::shared_ptr<DirEntry> parent,
                                                 const std::shared_ptr<Inode> &inode=nullptr);
+  ~DirEntry();
   uint block_size;
   EntryType type;
   std::string name;
   std::weak_ptr<DirEntry> parent;
   std::weak_ptr<DirEntry> self;
   std::shared_ptr<Inode> inode;
+  // guards contents, the index and removed; the members below take it
+  // themselves
+  mutable std::mutex lock;
+  // kept in insertion order for ls and tree; only modify through the
+  // members below so the index stays in sync
   std::list<std::shared_ptr<DirEntry>> contents;
-  bool is_locked;
+  // set once an rmdir has claimed this directory, so nothing new can be
+  // added to it
+  bool removed;
+  // set while the file is open
+  std::atomic<bool> is_locked;
 
   std::shared_ptr<DirEntry> find_child(const std::string name) const;
+  // the add members return nullptr / false if name is already taken or
+  // this directory has been removed
   std::shared_ptr<DirEntry> add_dir(const std::string name);
   std::shared_ptr<DirEntry> add_file(const std::string name);
+  bool add_entry(const std::shared_ptr<DirEntry> entry);
+  bool remove_child(const std::string name);
+  // mark an empty directory removed; false if it has entries
+  bool remove_if_empty();
+  // a copy of contents, to iterate without holding the lock
+  std::vector<std::shared_ptr<DirEntry>> entries() const;
   // move creation out to toyfs
 };
 
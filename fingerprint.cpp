@@ -0,0 +1,65 @@
+#include "fingerprint.hpp"
+#include <cstring>
+
+// the xxHash64 primes
+const uint64_t PRIME1 = 0x9e3779b185ebca87ULL;
+const uint64_t PRIME2 = 0xc2b2ae3d27d4eb4fULL;
+const uint64_t PRIME3 = 0x165667b19e3779f9ULL;
+const uint64_t PRIME4 = 0x85ebca77c2b2ae63ULL;
+const uint64_t PRIME5 = 0x27d4eb2f165667c5ULL;
+// bytes taken by each pass over the lanes
+const uint STRIPE = 32;
+
+static uint64_t read64(const char *p) {
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static uint64_t rotl(uint64_t x, int bits) {
+  return x << bits | x >> (64 - bits);
+}
+
+static uint64_t mix_lane(uint64_t acc, uint64_t input) {
+  return rotl(acc + input * PRIME2, 31) * PRIME1;
+}
+
+// xxHash64: the data is split across four independent lanes, so the
+// multiplies of each stripe don't wait on one another and the compiler
+// can keep the lanes in vector registers
+uint64_t fingerprint(const char *data, uint len) {
+  const char *p = data;
+  const char *end = data + len;
+  uint64_t hash;
+  if (len >= STRIPE) {
+    uint64_t lanes[4] = {PRIME1 + PRIME2, PRIME2, 0, 0 - PRIME1};
+    for (; end - p >= STRIPE; p += STRIPE) {
+      for (int i = 0; i < 4; ++i) {
+        lanes[i] = mix_lane(lanes[i], read64(p + 8 * i));
+      }
+    }
+    hash = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) +
+        rotl(lanes[3], 18);
+    for (uint64_t lane : lanes) {
+      hash = (hash ^ mix_lane(0, lane)) * PRIME1 + PRIME4;
+    }
+  } else {
+    hash = PRIME5;
+  }
+  hash += len;
+
+  for (; end - p >= 8; p += 8) {
+    hash = rotl(hash ^ mix_lane(0, read64(p)), 27) * PRIME1 + PRIME4;
+  }
+  for (; p < end; ++p) {
+    hash = rotl(hash ^ static_cast<uint8_t>(*p) * PRIME5, 11) * PRIME1;
+  }
+
+  // mix the last bits in
+  hash ^= hash >> 33;
+  hash *= PRIME2;
+  hash ^= hash >> 29;
+  hash *= PRIME3;
+  hash ^= hash >> 32;
+  return hash;
+}
@@ -0,0 +1,12 @@
+#ifndef _FINGERPRINT_H_
+#define _FINGERPRINT_H_
+
+#include <cstdint>
+#include <sys/types.h>
+
+// A fast 64-bit hash of a block's contents, for finding blocks that
+// hold the same data. Equal fingerprints make equal data likely, not
+// certain, so a match still has to be compared.
+uint64_t fingerprint(const char *data, uint len);
+
+#endif /* _FINGERPRINT_H_ */
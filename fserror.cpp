@@ -0,0 +1,28 @@
+#include "fserror.hpp"
+
+const char *fs_strerror(FsError error) {
+  switch (error) {
+    case FS_OK: return "Success";
+    case FS_INVALID_PATH: return "Invalid path";
+    case FS_NOT_FOUND: return "No such file or directory";
+    case FS_EXISTS: return "File exists";
+    case FS_NOT_FILE: return "Not a file";
+    case FS_NOT_DIR: return "Not a directory";
+    case FS_IS_ROOT: return "Root directory";
+    case FS_IS_CWD: return "Working directory";
+    case FS_NOT_EMPTY: return "Directory not empty";
+    case FS_BUSY: return "File is open";
+    case FS_BAD_FD: return "File descriptor not open";
+    case FS_BAD_MODE: return "Descriptor not open for that";
+    case FS_PAST_END: return "Beyond end of file";
+    case FS_TOO_LARGE: return "File too large";
+    case FS_NO_SPACE: return "No space left on disk";
+    case FS_SAME_DIR: return "Same directory";
+    case FS_HOST_IO: return "Unable to open host file";
+    case FS_TOO_MANY_OPEN: return "Too many open files";
+    case FS_CORRUPT: return "Checksum mismatch";
+    case FS_BAD_VERSION: return "Unsupported image version";
+    case FS_BAD_IMAGE: return "Corrupt image metadata";
+  }
+  return "Unknown error";
+}
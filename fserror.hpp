@@ -0,0 +1,58 @@
+#ifndef _FSERROR_H_
+#define _FSERROR_H_
+
+#include <utility>
+
+// why a ToyFS call failed
+enum FsError {
+  FS_OK = 0,
+  FS_INVALID_PATH,  // a directory on the way doesn't exist
+  FS_NOT_FOUND,
+  FS_EXISTS,
+  FS_NOT_FILE,
+  FS_NOT_DIR,
+  FS_IS_ROOT,
+  FS_IS_CWD,        // removing the working directory
+  FS_NOT_EMPTY,
+  FS_BUSY,          // the file is open
+  FS_BAD_FD,
+  FS_BAD_MODE,      // the descriptor isn't open for reading or writing
+  FS_PAST_END,
+  FS_TOO_LARGE,     // more than an inode can hold
+  FS_NO_SPACE,
+  FS_SAME_DIR,      // links must go in another directory
+  FS_HOST_IO,       // a host file couldn't be opened
+  FS_TOO_MANY_OPEN, // every descriptor is in use
+  FS_CORRUPT,       // data read back doesn't match its checksum
+  FS_BAD_VERSION,   // the image is from a newer or unknown toyfs
+  FS_BAD_IMAGE      // the image's metadata couldn't be loaded
+};
+
+// a short description, like strerror
+const char *fs_strerror(FsError error);
+
+// the value a call produced, or the reason it didn't
+template <typename T>
+class Result {
+  FsError err;
+  T val;
+
+ public:
+  Result(T value) : err(FS_OK), val(std::move(value)) {}
+  Result(FsError error) : err(error), val() {}
+  // an error that comes with a value, like the block FS_CORRUPT found
+  Result(FsError error, T value) : err(error), val(std::move(value)) {}
+
+  bool ok() const { return err == FS_OK; }
+  explicit operator bool() const { return ok(); }
+  FsError error() const { return err; }
+  // only meaningful when ok, or for an error that comes with one
+  T &value() { return val; }
+  const T &value() const { return val; }
+  T &operator*() { return val; }
+  const T &operator*() const { return val; }
+  T *operator->() { return &val; }
+  const T *operator->() const { return &val; }
+};
+
+#endif /* _FSERROR_H_ */
@@ -1,54 +1,138 @@
 #include "inode.hpp"
 #include <algorithm>
-#include <list>
+#include <iterator>
+#include <limits>
 #include <vector>
 
-using std::list;
-using std::shared_ptr;
-using std::sort;
+using std::max;
+using std::min;
+using std::numeric_limits;
+using std::prev;
+using std::upper_bound;
 using std::vector;
 
 uint Inode::block_size = 0;
-list<FreeNode> * Inode::free_list = nullptr;
+uint Inode::inline_max = 0;
+uint Inode::cluster_blocks = 1;
+BlockAllocator * Inode::allocator = nullptr;
 
 Inode::Inode()
-    : size(0), blocks_used(0), i_blocks(new vector<vector<uint>>()) {}
+    : links(0), size(0), blocks_used(0), compressed(false) {}
 
 Inode::~Inode() {
-  if (blocks_used == 0) {
-    return;
-  } else if (blocks_used == 1) {
-    free_list->emplace_front(block_size, d_blocks[0]);
+  release_blocks();
+}
+
+void Inode::release_blocks() {
+  for (auto &ext : extents) {
+    if (allocator != nullptr) {
+      allocator->free(ext.start, ext.length);
+    }
+  }
+  extents.clear();
+  for (auto &cluster : clusters) {
+    if (allocator != nullptr && cluster.blocks > 0) {
+      allocator->free(cluster.start, cluster.blocks);
+    }
   }
+  clusters.clear();
+  checksums.clear();
+  inline_data.clear();
+  blocks_used = 0;
+}
 
-  vector<uint> blocks;
+void Inode::clone_blocks(const Inode &src, Inode *replaced) {
+  replaced->extents.swap(extents);
+  replaced->clusters.swap(clusters);
+  release_blocks();
+  extents = src.extents;
+  for (auto &ext : extents) {
+    allocator->share(ext.start, ext.length);
+  }
+  clusters = src.clusters;
+  for (auto &cluster : clusters) {
+    if (cluster.blocks > 0) {
+      allocator->share(cluster.start, cluster.blocks);
+    }
+  }
+  compressed = src.compressed;
+  checksums = src.checksums;
+  inline_data = src.inline_data;
+  size = src.size;
+  blocks_used = src.blocks_used;
+}
+
+bool Inode::map_block(uint file_block, uint *disk_block, uint *run) const {
+  // binary search for the last extent starting at or before file_block
+  auto after = [] (uint block, const Extent &ext) {
+    return block < ext.file_block;
+  };
+  auto it = upper_bound(begin(extents), end(extents), file_block, after);
+  // in a hole, the run is up to the next extent
+  *run = it == end(extents) ? numeric_limits<uint>::max() - file_block
+                            : it->file_block - file_block;
+  if (it == begin(extents)) {
+    return false;
+  }
+  --it;
+  uint offset = file_block - it->file_block;
+  if (offset >= it->length) {
+    return false;
+  }
+  *disk_block = it->start + offset;
+  *run = it->length - offset;
+  return true;
+}
 
-  for (uint block : d_blocks) {
-    blocks.push_back(block);
+void Inode::set_blocks(uint file_block, uint start, uint count) {
+  uint range_end = file_block + count;
+  auto after = [] (uint block, const Extent &ext) {
+    return block < ext.file_block;
+  };
+  // extents from first up to last overlap the new range
+  auto first = upper_bound(begin(extents), end(extents), file_block, after);
+  if (first != begin(extents) &&
+      prev(first)->file_block + prev(first)->length > file_block) {
+    --first;
+  }
+  auto last = first;
+  uint replaced = 0;
+  for (; last != end(extents) && last->file_block < range_end; ++last) {
+    replaced += min(last->file_block + last->length, range_end) -
+        max(last->file_block, file_block);
   }
+  blocks_used += count - replaced;
 
-  for (auto vec: *i_blocks) {
-    for (uint block: vec) {
-      blocks.push_back(block);
+  // the overlapped span becomes whatever sticks out before the new
+  // range, the new extent, and whatever sticks out after it
+  vector<Extent> span;
+  if (first != last && first->file_block < file_block) {
+    span.push_back(Extent{first->file_block, first->start,
+                          file_block - first->file_block});
+  }
+  span.push_back(Extent{file_block, start, count});
+  if (first != last) {
+    const Extent &back = *prev(last);
+    uint back_end = back.file_block + back.length;
+    if (back_end > range_end) {
+      span.push_back(Extent{range_end, back.start + (range_end - back.file_block),
+                            back_end - range_end});
     }
   }
+  size_t at = first - begin(extents);
+  extents.erase(first, last);
+  extents.insert(begin(extents) + at, begin(span), end(span));
 
-  sort(begin(blocks), end(blocks));
-
-  uint start = blocks.front();
-  uint last = start;
-  uint size = block_size;
-  blocks.erase(begin(blocks));
-  for (uint block : blocks) {
-    if (block - last != block_size) {
-      free_list->emplace_back(size, start);
-      last = start = block;
-      size = 0;
-    } else {
-      last = block;
-      size += block_size;
+  // merge with physically contiguous neighbours
+  size_t lo = at > 0 ? at - 1 : 0;
+  size_t hi = min(extents.size() - 1, at + span.size());
+  for (size_t i = hi; i > lo; --i) {
+    Extent &a = extents[i - 1];
+    Extent &b = extents[i];
+    if (a.file_block + a.length == b.file_block &&
+        a.start + a.length == b.start) {
+      a.length += b.length;
+      extents.erase(begin(extents) + i);
     }
   }
-  free_list->emplace_front(size, start);
 }
-
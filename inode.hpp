@@ -2,24 +2,76 @@
 #define _INODE_H_
 
 #include <sys/types.h>
-#include <list>
+#include <atomic>
+#include <cstdint>
 #include <memory>
+#include <mutex>
 #include <vector>
 #include <string>
-#include "freenode.hpp"
+#include "allocator.hpp"
 
 
 class Inode {
  public:
+  // a run of file blocks stored in consecutive disk blocks
+  struct Extent {
+    uint file_block;
+    uint start;
+    uint length;
+  };
+  // a cluster of a compressed file: its data compressed into blocks
+  // consecutive blocks from start. bytes is the compressed length, or 0
+  // if it didn't compress and is stored as is; a hole has no blocks.
+  struct Cluster {
+    uint start;
+    uint blocks;
+    uint bytes;
+  };
+
   static uint block_size;
-  static std::list<FreeNode> *free_list;
+  // the blocks of data each cluster of a compressed file holds
+  static uint cluster_blocks;
+  // files up to this size keep their data in the inode
+  static uint inline_max;
+  // where blocks go back to; null while the journal is replayed
+  static BlockAllocator *allocator;
+  // held by whoever reads or changes the members below; the members
+  // don't take it themselves
+  std::mutex lock;
+  // the directory entries naming this inode, kept by DirEntry
+  std::atomic<uint> links;
   uint size;
+  // blocks mapped, which is fewer than size needs if the file has holes
   uint blocks_used;
-  std::vector<uint> d_blocks;
-  std::unique_ptr<std::vector<std::vector<uint>>> i_blocks;
+  // sorted by file_block
+  std::vector<Extent> extents;
+  // the contents of a file with no blocks; it moves to a block once the
+  // file grows past inline_max
+  std::string inline_data;
+  // compressed files keep their blocks in clusters, indexed by file
+  // block / cluster_blocks, and have no extents
+  bool compressed;
+  std::vector<Cluster> clusters;
+  // the CRC-32C of each file block, or of each cluster's stored blocks
+  // for compressed files; entries for holes mean nothing
+  std::vector<uint32_t> checksums;
 
   Inode();
   ~Inode();
+
+  // find the disk block holding file_block, and how many blocks from
+  // there on are contiguous on disk. Returns false if it is in a hole,
+  // with run set to the blocks left until the next mapped one.
+  bool map_block(uint file_block, uint *disk_block, uint *run) const;
+  // map file blocks file_block.. onto disk blocks start.., replacing
+  // whatever they were mapped to before (the caller frees that)
+  void set_blocks(uint file_block, uint start, uint count);
+  // drop our blocks and data and share src's instead, copy-on-write.
+  // Our old blocks move to replaced, which frees them when it goes, so
+  // the change can be logged first.
+  void clone_blocks(const Inode &src, Inode *replaced);
+  // hand every block back to the allocator and drop inline data
+  void release_blocks();
 };
 
 #endif /* _INODE_H_ */
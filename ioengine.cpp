@@ -0,0 +1,343 @@
+#include "ioengine.hpp"
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+#endif
+
+using std::cerr;
+using std::condition_variable;
+using std::endl;
+using std::function;
+using std::lock_guard;
+using std::make_shared;
+using std::mutex;
+using std::shared_ptr;
+using std::thread;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+
+// requests the ring holds at once
+const uint URING_ENTRIES = 256;
+// threads used when there is no io_uring
+const uint POOL_THREADS = 4;
+
+unique_ptr<IOEngine> IOEngine::create(Storage &disk) {
+  int fd = disk.file_descriptor();
+  if (fd >= 0) {
+    unique_ptr<UringEngine> uring(new UringEngine(disk, fd, URING_ENTRIES));
+    if (uring->is_open()) {
+      return unique_ptr<IOEngine>(uring.release());
+    }
+  }
+  return unique_ptr<IOEngine>(new ThreadPoolEngine(disk, POOL_THREADS));
+}
+
+void IOEngine::run(vector<IORequest> requests) {
+  mutex lock;
+  condition_variable finished;
+  bool done = false;
+  submit(std::move(requests), [&] () {
+    lock_guard<mutex> guard(lock);
+    done = true;
+    finished.notify_one();
+  });
+  unique_lock<mutex> guard(lock);
+  finished.wait(guard, [&] () {return done;});
+}
+
+struct UringEngine::Batch {
+  std::atomic<uint> left;
+  function<void()> done;
+};
+
+struct UringEngine::Pending {
+  IORequest request;
+  iovec iov;
+  shared_ptr<Batch> batch;
+};
+
+#ifdef HAVE_IO_URING
+
+static int uring_enter(int ring_fd, uint to_submit, uint min_complete,
+                       uint flags) {
+  return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags,
+                 nullptr, 0);
+}
+
+// hand to_submit queued entries to the kernel
+static void submit_entries(int ring_fd, uint to_submit) {
+  while (to_submit > 0) {
+    int n = uring_enter(ring_fd, to_submit, 0, 0);
+    if (n < 0) {
+      if (errno == EINTR || errno == EAGAIN) continue;
+      cerr << "error: io_uring submit failed: " << strerror(errno) << endl;
+      return;
+    }
+    to_submit -= n;
+  }
+}
+
+UringEngine::UringEngine(Storage &disk, int fd, uint entries)
+    : disk(disk), fd(fd) {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring_fd < 0) {
+    return;
+  }
+  this->entries = params.sq_entries;
+
+  sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+  void *sqe_mem = mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe),
+                       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring_fd, IORING_OFF_SQES);
+  if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqe_mem == MAP_FAILED) {
+    if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+    if (cq_ring != MAP_FAILED) munmap(cq_ring, cq_ring_size);
+    if (sqe_mem != MAP_FAILED) {
+      munmap(sqe_mem, params.sq_entries * sizeof(io_uring_sqe));
+    }
+    sq_ring = cq_ring = nullptr;
+    ::close(ring_fd);
+    ring_fd = -1;
+    return;
+  }
+  sqes = static_cast<io_uring_sqe *>(sqe_mem);
+
+  char *sq = static_cast<char *>(sq_ring);
+  sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+  sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+  sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+  sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+  char *cq = static_cast<char *>(cq_ring);
+  cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+  cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+  cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+  cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+  reaper = thread(&UringEngine::reap, this);
+}
+
+UringEngine::~UringEngine() {
+  if (ring_fd < 0) {
+    return;
+  }
+  {
+    // let everything in flight land, then wake the reaper with an
+    // entry that tells it to stop
+    unique_lock<mutex> guard(lock);
+    space.wait(guard, [this] () {return in_flight == 0;});
+    push(nullptr, IORING_OP_NOP);
+    submit_entries(ring_fd, 1);
+  }
+  reaper.join();
+  munmap(sqes, entries * sizeof(io_uring_sqe));
+  munmap(sq_ring, sq_ring_size);
+  munmap(cq_ring, cq_ring_size);
+  ::close(ring_fd);
+}
+
+// queue one entry; called with lock held, so we are the only writer of
+// the submission tail
+void UringEngine::push(Pending *pending, uint8_t opcode) {
+  unsigned tail = *sq_tail;
+  unsigned index = tail & *sq_mask;
+  io_uring_sqe *sqe = &sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->user_data = reinterpret_cast<uint64_t>(pending);
+  if (pending != nullptr) {
+    sqe->fd = fd;
+    sqe->off = pending->request.addr;
+    sqe->addr = reinterpret_cast<uint64_t>(&pending->iov);
+    sqe->len = 1;
+  }
+  sq_array[index] = index;
+  __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+void UringEngine::submit(vector<IORequest> requests, function<void()> done) {
+  if (requests.empty()) {
+    done();
+    return;
+  }
+  auto batch = make_shared<Batch>();
+  batch->left = requests.size();
+  batch->done = std::move(done);
+
+  unique_lock<mutex> guard(lock);
+  uint queued = 0;
+  for (auto &request : requests) {
+    if (in_flight == entries) {
+      // the completion queue could overflow: send what we have and wait
+      // for the reaper to make room
+      submit_entries(ring_fd, queued);
+      queued = 0;
+      space.wait(guard, [this] () {return in_flight < entries;});
+    }
+    auto pending = new Pending{request, iovec{request.buf, request.len}, batch};
+    push(pending, request.write ? IORING_OP_WRITEV : IORING_OP_READV);
+    ++in_flight;
+    ++queued;
+  }
+  submit_entries(ring_fd, queued);
+}
+
+void UringEngine::reap() {
+  for (;;) {
+    if (uring_enter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+        errno != EINTR) {
+      cerr << "error: io_uring wait failed: " << strerror(errno) << endl;
+      return;
+    }
+    bool stop = false;
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+      io_uring_cqe &cqe = cqes[head & *cq_mask];
+      auto pending = reinterpret_cast<Pending *>(cqe.user_data);
+      if (pending == nullptr) {
+        stop = true;
+      } else {
+        finish(pending, cqe.res);
+      }
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    if (stop) {
+      return;
+    }
+  }
+}
+
+#else /* no io_uring: never opens, so create falls back to threads */
+
+UringEngine::UringEngine(Storage &disk, int fd, uint)
+    : disk(disk), fd(fd) {}
+
+UringEngine::~UringEngine() {}
+
+void UringEngine::push(Pending *, uint8_t) {}
+
+void UringEngine::submit(vector<IORequest> requests, function<void()> done) {
+  for (auto &request : requests) {
+    if (request.write) {
+      disk.write(request.addr, request.buf, request.len);
+    } else {
+      disk.read(request.addr, request.buf, request.len);
+    }
+  }
+  done();
+}
+
+void UringEngine::reap() {}
+
+#endif /* HAVE_IO_URING */
+
+// a request is done: errors and short transfers are finished off with
+// ordinary I/O before its batch is told
+void UringEngine::finish(Pending *pending, int result) {
+  IORequest &request = pending->request;
+  uint moved = result > 0 ? result : 0;
+  if (moved < request.len) {
+    if (result < 0) {
+      cerr << "error: io_uring " << (request.write ? "write" : "read")
+           << " failed: " << strerror(-result) << ", retrying" << endl;
+    }
+    if (request.write) {
+      disk.write(request.addr + moved, request.buf + moved, request.len - moved);
+    } else {
+      disk.read(request.addr + moved, request.buf + moved, request.len - moved);
+    }
+  }
+  shared_ptr<Batch> batch = std::move(pending->batch);
+  delete pending;
+  {
+    lock_guard<mutex> guard(lock);
+    --in_flight;
+  }
+  space.notify_all();
+  if (batch != nullptr && --batch->left == 0) {
+    batch->done();
+  }
+}
+
+struct ThreadPoolEngine::Batch {
+  std::atomic<uint> left;
+  function<void()> done;
+};
+
+ThreadPoolEngine::ThreadPoolEngine(Storage &disk, uint threads)
+    : disk(disk) {
+  for (uint i = 0; i < threads; ++i) {
+    workers.push_back(thread(&ThreadPoolEngine::work, this));
+  }
+}
+
+ThreadPoolEngine::~ThreadPoolEngine() {
+  {
+    lock_guard<mutex> guard(lock);
+    stopping = true;
+  }
+  ready.notify_all();
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+void ThreadPoolEngine::submit(vector<IORequest> requests,
+                              function<void()> done) {
+  if (requests.empty()) {
+    done();
+    return;
+  }
+  auto batch = make_shared<Batch>();
+  batch->left = requests.size();
+  batch->done = std::move(done);
+  {
+    lock_guard<mutex> guard(lock);
+    for (auto &request : requests) {
+      jobs.push_back(Job{request, batch});
+    }
+  }
+  ready.notify_all();
+}
+
+// workers keep going until told to stop and the queue is empty
+void ThreadPoolEngine::work() {
+  for (;;) {
+    Job job;
+    {
+      unique_lock<mutex> guard(lock);
+      ready.wait(guard, [this] () {return stopping || !jobs.empty();});
+      if (jobs.empty()) {
+        return;
+      }
+      job = std::move(jobs.front());
+      jobs.pop_front();
+    }
+    IORequest &request = job.request;
+    if (request.write) {
+      disk.write(request.addr, request.buf, request.len);
+    } else {
+      disk.read(request.addr, request.buf, request.len);
+    }
+    if (--job.batch->left == 0) {
+      job.batch->done();
+    }
+  }
+}
@@ -0,0 +1,111 @@
+#ifndef _IOENGINE_H_
+#define _IOENGINE_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "storage.hpp"
+
+// one transfer between the disk and a buffer; writes only read from buf
+struct IORequest {
+  bool write;
+  uint addr;
+  char *buf;
+  uint len;
+};
+
+// Runs batches of disk requests asynchronously. The requests of a batch
+// may complete in any order and overlap each other; done is called once,
+// on an engine thread, after the last one finishes.
+class IOEngine {
+ public:
+  // io_uring on the image's file descriptor where the kernel allows it,
+  // otherwise a pool of threads doing ordinary Storage I/O
+  static std::unique_ptr<IOEngine> create(Storage &disk);
+  virtual ~IOEngine() {}
+  virtual const char *name() const = 0;
+  virtual void submit(std::vector<IORequest> requests,
+                      std::function<void()> done) = 0;
+  // submit a batch and wait for it
+  void run(std::vector<IORequest> requests);
+};
+
+// Submits each batch to an io_uring with one system call; a reaper
+// thread collects the completions. Talks to the kernel through the raw
+// system calls, so it needs no library.
+class UringEngine : public IOEngine {
+  struct Batch;
+  struct Pending;
+
+  Storage &disk;
+  const int fd;
+  int ring_fd = -1;
+  uint entries = 0;
+  // submission ring
+  void *sq_ring = nullptr;
+  size_t sq_ring_size = 0;
+  unsigned *sq_head = nullptr;
+  unsigned *sq_tail = nullptr;
+  unsigned *sq_mask = nullptr;
+  unsigned *sq_array = nullptr;
+  struct io_uring_sqe *sqes = nullptr;
+  // completion ring
+  void *cq_ring = nullptr;
+  size_t cq_ring_size = 0;
+  unsigned *cq_head = nullptr;
+  unsigned *cq_tail = nullptr;
+  unsigned *cq_mask = nullptr;
+  struct io_uring_cqe *cqes = nullptr;
+
+  // submitters wait here while the ring holds as many requests as the
+  // completion queue can take
+  std::mutex lock;
+  std::condition_variable space;
+  uint in_flight = 0;
+  std::thread reaper;
+
+  void push(Pending *pending, uint8_t opcode);
+  void reap();
+  void finish(Pending *pending, int result);
+
+ public:
+  UringEngine(Storage &disk, int fd, uint entries);
+  ~UringEngine();
+  // whether the kernel let us set the ring up
+  bool is_open() const { return ring_fd >= 0; }
+  const char *name() const { return "io_uring"; }
+  void submit(std::vector<IORequest> requests, std::function<void()> done);
+};
+
+// Hands requests to a fixed set of threads doing blocking Storage I/O
+class ThreadPoolEngine : public IOEngine {
+  struct Batch;
+  struct Job {
+    IORequest request;
+    std::shared_ptr<Batch> batch;
+  };
+
+  Storage &disk;
+  std::mutex lock;
+  std::condition_variable ready;
+  std::deque<Job> jobs;
+  bool stopping = false;
+  std::vector<std::thread> workers;
+
+  void work();
+
+ public:
+  ThreadPoolEngine(Storage &disk, uint threads);
+  ~ThreadPoolEngine();
+  const char *name() const { return "threads"; }
+  void submit(std::vector<IORequest> requests, std::function<void()> done);
+};
+
+#endif /* _IOENGINE_H_ */
@@ -0,0 +1,158 @@
+#include "journal.hpp"
+#include <cstring>
+#include "ondisk.hpp"
+
+using std::lock_guard;
+using std::mutex;
+using std::string;
+using std::unique_lock;
+using std::vector;
+
+const uint32_t JOURNAL_MAGIC = 0x6c6e726a;  // "jrnl"
+
+struct GroupHeader {
+  uint32_t magic;
+  uint32_t epoch;
+  uint32_t sequence;
+  uint32_t bytes;
+  uint32_t checksum;
+};
+
+Journal::Journal(BlockCache &cache, uint block_size)
+    : cache(cache), block_size(block_size) {}
+
+void Journal::attach(uint start, uint blocks, uint32_t epoch) {
+  lock_guard<mutex> guard(lock);
+  this->start = start;
+  this->blocks = blocks;
+  this->epoch = epoch;
+  pending.clear();
+  durable = appended;
+  in_log = appended;
+  tail = 0;
+  next_group = 0;
+  overflowed = false;
+}
+
+void Journal::append(const string &record) {
+  lock_guard<mutex> guard(lock);
+  if (blocks == 0 || overflowed) {
+    return;
+  }
+  uint32_t len = record.size();
+  pending.append(reinterpret_cast<const char *>(&len), sizeof(len));
+  pending.append(record);
+  ++appended;
+}
+
+void Journal::commit() {
+  unique_lock<mutex> guard(lock);
+  uint64_t target = appended;
+  while (durable < target) {
+    if (committing) {
+      // the group being written may not hold our records; wait and see
+      committed.wait(guard);
+      continue;
+    }
+
+    // lead a group with everything queued so far
+    committing = true;
+    string records;
+    records.swap(pending);
+    uint64_t upto = appended;
+    uint group_blocks =
+        (sizeof(GroupHeader) + records.size() + block_size - 1) / block_size;
+    bool fits = !overflowed && tail + group_blocks <= blocks;
+    uint group_start = start + tail;
+    GroupHeader header = {JOURNAL_MAGIC, epoch, next_group,
+                          static_cast<uint32_t>(records.size()),
+                          crc32c(records.data(), records.size())};
+    if (fits) {
+      tail += group_blocks;
+      ++next_group;
+    } else {
+      overflowed = true;
+    }
+    guard.unlock();
+
+    // ordered: the file data the records point at is durable before the
+    // group is written, so replay never maps blocks that aren't there
+    cache.sync();
+    if (fits) {
+      string group(group_blocks * block_size, '\0');
+      memcpy(&group[0], &header, sizeof(header));
+      memcpy(&group[sizeof(header)], records.data(), records.size());
+      cache.write(group_start * block_size, group.data(), group.size());
+      cache.sync();
+    }
+
+    guard.lock();
+    durable = upto;
+    if (fits) {
+      in_log = upto;
+    }
+    committing = false;
+    committed.notify_all();
+  }
+}
+
+uint64_t Journal::position() {
+  lock_guard<mutex> guard(lock);
+  return appended;
+}
+
+uint64_t Journal::logged() {
+  lock_guard<mutex> guard(lock);
+  return in_log;
+}
+
+bool Journal::full() {
+  lock_guard<mutex> guard(lock);
+  return overflowed;
+}
+
+void Journal::reset(uint32_t new_epoch) {
+  unique_lock<mutex> guard(lock);
+  committed.wait(guard, [this] () {return !committing;});
+  epoch = new_epoch;
+  pending.clear();
+  durable = appended;
+  in_log = appended;
+  tail = 0;
+  next_group = 0;
+  overflowed = false;
+}
+
+vector<string> Journal::replay() {
+  lock_guard<mutex> guard(lock);
+  vector<string> records;
+  tail = 0;
+  next_group = 0;
+  while (tail < blocks) {
+    GroupHeader header;
+    cache.read((start + tail) * block_size, reinterpret_cast<char *>(&header),
+               sizeof(header));
+    uint group_blocks =
+        (sizeof(GroupHeader) + header.bytes + block_size - 1) / block_size;
+    if (header.magic != JOURNAL_MAGIC || header.epoch != epoch ||
+        header.sequence != next_group || group_blocks > blocks - tail) {
+      break;
+    }
+    string group(header.bytes, '\0');
+    cache.read((start + tail) * block_size + sizeof(header), &group[0],
+               header.bytes);
+    if (crc32c(group.data(), group.size()) != header.checksum) {
+      // torn: the crash came while this group was being written
+      break;
+    }
+
+    MetaReader in(group);
+    string record;
+    while (in.str(&record)) {
+      records.push_back(record);
+    }
+    tail += group_blocks;
+    ++next_group;
+  }
+  return records;
+}
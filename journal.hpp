@@ -0,0 +1,76 @@
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include "blockcache.hpp"
+
+// Write-ahead log of the changes made since the last checkpoint, kept in
+// a fixed run of blocks. Records are queued in memory by append and
+// written by commit in groups: whoever commits first writes everything
+// queued so far, and commits arriving meanwhile wait for it and then go
+// out together as the next group. A group is only written once the
+// cached data written before it has been synced, and is then synced
+// itself.
+//
+// Each group is a header (magic, epoch, sequence number, length and
+// checksum) followed by its records, padded to whole blocks. A
+// checkpoint starts a new epoch, which retires the whole log at once;
+// replay stops at the first group that is torn or from another epoch.
+class Journal {
+  BlockCache &cache;
+  const uint block_size;
+  uint start = 0;
+  uint blocks = 0;
+  uint32_t epoch = 0;
+
+  std::mutex lock;
+  std::condition_variable committed;
+  // records appended but not yet committed, each a u32 length and bytes
+  std::string pending;
+  uint64_t appended = 0;
+  uint64_t durable = 0;
+  // like durable, but only counting records that reached the log
+  uint64_t in_log = 0;
+  bool committing = false;
+  // next free block and group number in the log
+  uint tail = 0;
+  uint32_t next_group = 0;
+  // set when a group didn't fit; nothing more is logged until the next
+  // checkpoint, which the owner must take before relying on durability
+  bool overflowed = false;
+
+ public:
+  Journal(BlockCache &cache, uint block_size);
+
+  // use blocks blocks from start for the log, holding records of epoch;
+  // 0 blocks turns logging off
+  void attach(uint start, uint blocks, uint32_t epoch);
+  uint first_block() const { return start; }
+  uint num_blocks() const { return blocks; }
+  uint32_t current_epoch() const { return epoch; }
+
+  void append(const std::string &record);
+  // make every record appended so far durable, along with all the
+  // cached data written before
+  void commit();
+  // how many records have been appended, and how many of them are
+  // durable in the log or covered by a checkpoint; records dropped for
+  // lack of room only count once the checkpoint after them resets the log
+  uint64_t position();
+  uint64_t logged();
+  // whether records have been dropped for lack of room
+  bool full();
+  // forget everything logged; called once a checkpoint covering it is
+  // durable
+  void reset(uint32_t new_epoch);
+  // the records committed in the current epoch, in order; later commits
+  // go after them
+  std::vector<std::string> replay();
+};
+
+#endif /* _JOURNAL_H_ */
@@ -0,0 +1,63 @@
+#ifndef _LRUCACHE_H_
+#define _LRUCACHE_H_
+
+#include <cstddef>
+#include <functional>
+#include <list>
+#include <unordered_map>
+#include <utility>
+#include <sys/types.h>
+
+// A bounded map that evicts the least recently used entry when full.
+template <typename K, typename V, typename Hash = std::hash<K>>
+class LRUCache {
+  typedef std::list<std::pair<K, V>> List;
+  List entries;
+  std::unordered_map<K, typename List::iterator, Hash> index;
+  const size_t capacity;
+
+ public:
+  uint hits = 0;
+  uint misses = 0;
+
+  explicit LRUCache(size_t capacity) : capacity(capacity) {}
+
+  // returns nullptr on a miss
+  V *get(const K &key) {
+    auto it = index.find(key);
+    if (it == index.end()) {
+      ++misses;
+      return nullptr;
+    }
+    ++hits;
+    entries.splice(entries.begin(), entries, it->second);
+    return &it->second->second;
+  }
+
+  void put(const K &key, const V &value) {
+    auto it = index.find(key);
+    if (it != index.end()) {
+      it->second->second = value;
+      entries.splice(entries.begin(), entries, it->second);
+      return;
+    }
+    if (capacity == 0) {
+      return;
+    }
+    if (entries.size() >= capacity) {
+      index.erase(entries.back().first);
+      entries.pop_back();
+    }
+    entries.emplace_front(key, value);
+    index[key] = entries.begin();
+  }
+
+  void clear() {
+    entries.clear();
+    index.clear();
+  }
+
+  size_t size() const { return entries.size(); }
+};
+
+#endif /* _LRUCACHE_H_ */
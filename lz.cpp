@@ -0,0 +1,160 @@
+#include "lz.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+using std::min;
+using std::vector;
+
+// shorter matches aren't worth their offset
+const uint MIN_MATCH = 4;
+const uint MAX_OFFSET = 65535;
+// the match finder remembers one position per 2^HASH_BITS hashes
+const uint HASH_BITS = 12;
+
+static uint32_t read32(const char *p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static uint hash(uint32_t sequence) {
+  return (sequence * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// appends to a buffer, remembering if anything didn't fit
+class Output {
+  char *buf;
+  uint cap;
+ public:
+  uint pos = 0;
+  bool ok = true;
+
+  Output(char *buf, uint cap) : buf(buf), cap(cap) {}
+  void byte(uint8_t value) {
+    if (pos < cap) {
+      buf[pos++] = value;
+    } else {
+      ok = false;
+    }
+  }
+  void bytes(const char *data, uint len) {
+    if (len > cap - pos) {
+      ok = false;
+      return;
+    }
+    memcpy(buf + pos, data, len);
+    pos += len;
+  }
+  // the part of a length that didn't fit in its nibble
+  void length(uint n) {
+    for (; n >= 255; n -= 255) {
+      byte(255);
+    }
+    byte(n);
+  }
+};
+
+// one sequence; a match_len of 0 makes it the last
+static void sequence(Output *out, const char *literals, uint literal_len,
+                     uint offset, uint match_len) {
+  uint match_code = match_len == 0 ? 0 : match_len - MIN_MATCH;
+  out->byte(min(literal_len, 15u) << 4 | min(match_code, 15u));
+  if (literal_len >= 15) {
+    out->length(literal_len - 15);
+  }
+  out->bytes(literals, literal_len);
+  if (match_len > 0) {
+    out->byte(offset & 0xff);
+    out->byte(offset >> 8);
+    if (match_code >= 15) {
+      out->length(match_code - 15);
+    }
+  }
+}
+
+uint lz_compress(const char *in, uint len, char *out, uint cap) {
+  Output output(out, cap);
+  // the position + 1 of the last sequence seen with each hash
+  vector<uint> table(1 << HASH_BITS, 0);
+  uint anchor = 0;
+  for (uint i = 0; len >= MIN_MATCH && i <= len - MIN_MATCH && output.ok;) {
+    uint32_t next = read32(in + i);
+    uint h = hash(next);
+    uint candidate = table[h];
+    table[h] = i + 1;
+    if (candidate == 0 || i - (candidate - 1) > MAX_OFFSET ||
+        read32(in + candidate - 1) != next) {
+      ++i;
+      continue;
+    }
+    uint match = candidate - 1;
+    uint match_len = MIN_MATCH;
+    while (i + match_len < len && in[match + match_len] == in[i + match_len]) {
+      ++match_len;
+    }
+    sequence(&output, in + anchor, i - anchor, i - match, match_len);
+    i += match_len;
+    anchor = i;
+  }
+  sequence(&output, in + anchor, len - anchor, 0, 0);
+  return output.ok ? output.pos : 0;
+}
+
+bool lz_decompress(const char *in, uint len, char *out, uint out_len) {
+  uint ip = 0;
+  uint op = 0;
+  auto length = [&] (uint *n) {
+    uint8_t more;
+    do {
+      if (ip >= len) {
+        return false;
+      }
+      more = in[ip++];
+      *n += more;
+    } while (more == 255);
+    return true;
+  };
+
+  while (ip < len) {
+    uint8_t token = in[ip++];
+    uint literal_len = token >> 4;
+    if (literal_len == 15 && !length(&literal_len)) {
+      return false;
+    }
+    if (literal_len > len - ip || literal_len > out_len - op) {
+      return false;
+    }
+    memcpy(out + op, in + ip, literal_len);
+    ip += literal_len;
+    op += literal_len;
+    if (ip == len) {
+      return op == out_len;
+    }
+
+    if (len - ip < 2) {
+      return false;
+    }
+    uint offset = static_cast<uint8_t>(in[ip]) |
+        static_cast<uint8_t>(in[ip + 1]) << 8;
+    ip += 2;
+    uint match_len = (token & 15) + MIN_MATCH;
+    if ((token & 15) == 15 && !length(&match_len)) {
+      return false;
+    }
+    if (offset == 0 || offset > op || match_len > out_len - op) {
+      return false;
+    }
+    if (offset >= match_len) {
+      memcpy(out + op, out + op - offset, match_len);
+      op += match_len;
+    } else {
+      // the match overlaps what it produces
+      for (uint end = op + match_len; op < end; ++op) {
+        out[op] = out[op - offset];
+      }
+    }
+  }
+  return false;
+}
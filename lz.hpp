@@ -0,0 +1,21 @@
+#ifndef _LZ_H_
+#define _LZ_H_
+
+#include <sys/types.h>
+
+// A small LZ77 codec in the style of LZ4, for compressing file data.
+//
+// The output is a series of sequences, each a token byte (literal count
+// in the high nibble, match length - 4 in the low one; 15 means more
+// length bytes follow, each added on until one is below 255), the
+// literals, then a 2-byte offset back into the output and any extra
+// match length bytes. The last sequence has literals only.
+
+// compress len bytes into out; returns the compressed length, or 0 if
+// it would take more than cap bytes
+uint lz_compress(const char *in, uint len, char *out, uint cap);
+// expand len compressed bytes into exactly out_len bytes of out; false
+// if the data is corrupt
+bool lz_decompress(const char *in, uint len, char *out, uint out_len);
+
+#endif /* _LZ_H_ */
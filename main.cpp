@@ -1,162 +1,416 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <string>
-#include <sstream>
+#include <unordered_map>
 #include <vector>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "shell.hpp"
 #include "toyfs.hpp"
 
 using std::cerr;
 using std::cin;
 using std::cout;
 using std::endl;
+using std::fixed;
+using std::fstream;
+using std::future;
 using std::getline;
-using std::istringstream;
 using std::make_shared;
+using std::setprecision;
 using std::shared_ptr;
 using std::string;
+using std::unordered_map;
 using std::vector;
 
 const string PRMPT = "sh> ";
 const uint DISKSIZE = 100000000;
 const uint BLOCKSIZE = 1024;
 const uint DIRECTBLOCKS = 100;
+const uint CACHEBLOCKS = 1024;
 
-int test_fs(const string filename) {
-  ToyFS myfs(filename, DISKSIZE, BLOCKSIZE, DIRECTBLOCKS);
-
-  myfs.mkdir({"mkdir", "dir-2"});
-  myfs.mkdir({"mkdir", "dir-2/dir-b"});
-  myfs.mkdir({"mkdir", "dir-2/dir-b/dir-deep"});
-  myfs.open({"open", "somefile", "w"});
-  myfs.open({"open", "somefile2", "w"});
-  myfs.write({"write", "0", "hi there buddy"});
-  myfs.close({"close", "0"});
-  myfs.open({"open", "somefile", "r"});
-  myfs.seek({"seek", "2", "3"});
-  myfs.read({"read", "2", "5"});
-  myfs.ls({"ls"});
-  myfs.close({"close", "1"});
-  myfs.close({"close", "2"});
-  myfs.cat({"cat", "somefile"});
-  myfs.tree({"tree"});
-  myfs.import({"import", "exampleFile.txt", "ex.txt"});
-  myfs.cat({"cat", "somefile"});
-  myfs.cat({"cat", "ex.txt"});
-  myfs.link({"link", "ex.txt", "/dir-2/dir-b/linked"});
-  myfs.cat({"cat", "/dir-2/dir-b/linked"});
-  myfs.cp({"cp", "ex.txt", "newEx.txt"});
-  myfs.unlink({"unlink", "ex.txt"});
-  myfs.FS_export({"export", "dir-2/dir-b/linked", "newExFile.txt"});
-  myfs.tree({"tree"});
-  myfs.stat({"stat", "somefile", "somefile2", "dir-2/dir-b/linked"});
-  myfs.unlink({"unlink", "dir-2/dir-b/linked"});
-  myfs.rmdir({"rmdir", "dir-2/dir-b/dir-deep", "dir-2/dir-b", "dir-2"});
-  myfs.tree({"tree"});
-  myfs.mkdir({"mkdir", "ant"});
-  myfs.cd({"cd", "ant"});
-  myfs.printwd({"pwd"});
-  myfs.tree({"tree"});
+int test_fs(const string filename, const StorageMode mode, const bool async_io) {
+  ToyFS myfs(filename, DISKSIZE, BLOCKSIZE, DIRECTBLOCKS, CACHEBLOCKS, mode,
+             true, async_io);
+  Shell sh(myfs);
 
+  sh.mkdir({"mkdir", "dir-2"});
+  sh.mkdir({"mkdir", "dir-2/dir-b"});
+  sh.mkdir({"mkdir", "dir-2/dir-b/dir-deep"});
+  sh.open({"open", "somefile", "w"});
+  sh.open({"open", "somefile2", "w"});
+  sh.write({"write", "0", "hi there buddy"});
+  sh.close({"close", "0"});
+  sh.open({"open", "somefile", "r"});
+  sh.seek({"seek", "0", "3"});
+  sh.read({"read", "0", "5"});
+  sh.ls({"ls"});
+  sh.close({"close", "1"});
+  sh.close({"close", "0"});
+  sh.cat({"cat", "somefile"});
+  sh.tree({"tree"});
+  sh.import({"import", "exampleFile.txt", "ex.txt"});
+  sh.cat({"cat", "somefile"});
+  sh.cat({"cat", "ex.txt"});
+  sh.link({"link", "ex.txt", "/dir-2/dir-b/linked"});
+  sh.cat({"cat", "/dir-2/dir-b/linked"});
+  sh.cp({"cp", "ex.txt", "newEx.txt"});
+  sh.unlink({"unlink", "ex.txt"});
+  sh.FS_export({"export", "dir-2/dir-b/linked", "newExFile.txt"});
+  sh.tree({"tree"});
+  sh.stat({"stat", "somefile", "somefile2", "dir-2/dir-b/linked"});
+  sh.unlink({"unlink", "dir-2/dir-b/linked"});
+  sh.rmdir({"rmdir", "dir-2/dir-b/dir-deep", "dir-2/dir-b", "dir-2"});
+  sh.tree({"tree"});
+  sh.mkdir({"mkdir", "ant"});
+  sh.cd({"cd", "ant"});
+  sh.printwd({"pwd"});
+  sh.tree({"tree"});
+
+  return 0;
+}
+
+// a crash must leave the image as of the last commit: a child makes
+// changes, some of them committed, and is killed without unmounting,
+// then the image is mounted again
+int test_replay(const string filename, const StorageMode mode,
+                const bool async_io) {
+  cout.flush();
+  pid_t child = fork();
+  if (child == 0) {
+    ToyFS *fs = new ToyFS(filename, DISKSIZE, BLOCKSIZE, DIRECTBLOCKS,
+                          CACHEBLOCKS, mode, true, async_io);
+    Shell sh(*fs);
+    sh.import({"import", "exampleFile.txt", "kept.txt"});
+    sh.import({"import", "exampleFile.txt", "gone.txt"});
+    sh.mkdir({"mkdir", "dir"});
+    sh.unlink({"unlink", "gone.txt"});
+    sh.compress({"compress", "on"});
+    sh.import({"import", "exampleFile.txt", "dir/packed.txt"});
+    sh.compress({"compress", "off"});
+    // too big for the cache, so rewriting it goes straight to disk
+    string old_data(40 * BLOCKSIZE, 'a');
+    sh.open({"open", "big.txt", "w"});
+    sh.write({"write", "0", old_data});
+    sh.close({"close", "0"});
+    // rewriting a compressed file moves its clusters, and rewriting the
+    // committed blocks of any file copies them; the old ones must
+    // survive until the new ones are committed at close
+    sh.open({"open", "dir/packed.txt", "rw"});
+    sh.open({"open", "big.txt", "rw"});
+    sh.write({"write", "0", "not committed"});
+    sh.write({"write", "1", string(old_data.size(), 'b')});
+    kill(getpid(), SIGKILL);
+  }
+  waitpid(child, nullptr, 0);
+
+  ToyFS myfs(filename, DISKSIZE, BLOCKSIZE, DIRECTBLOCKS, CACHEBLOCKS, mode,
+             false, async_io);
+  Shell sh(myfs);
+  sh.tree({"tree"});
+  sh.cat({"cat", "dir/packed.txt"});
+  sh.open({"open", "big.txt", "r"});
+  sh.read({"read", "0", "16"});
+  sh.close({"close", "0"});
+  return 0;
+}
+
+// reads and writes of several files in flight at once, with a file
+// closed while its write is still going: each file must read back as
+// written
+int test_async(const string filename, const StorageMode mode,
+               const bool async_io) {
+  ToyFS myfs(filename, DISKSIZE, BLOCKSIZE, DIRECTBLOCKS, CACHEBLOCKS, mode,
+             true, async_io);
+  const uint FILES = 4;
+  // big enough to go past the cache, ending partway into a block
+  const uint SIZE = 200 * BLOCKSIZE + 123;
+  vector<string> names, data;
+  vector<uint> fds;
+  vector<future<Result<uint>>> pending;
+  for (uint f = 0; f < FILES; ++f) {
+    names.push_back("async" + std::to_string(f));
+    data.push_back(string(SIZE, '\0'));
+    for (uint i = 0; i < SIZE; ++i) {
+      data[f][i] = 'a' + (i / 7 + i % 5 + f * 3) % 26;
+    }
+    fds.push_back(*myfs.open(names[f], ToyFS::W));
+    pending.push_back(myfs.async_write(fds[f], data[f].data(), SIZE));
+  }
+  // closing commits the file, which waits for its data to land
+  myfs.close(fds[0]);
+  for (auto &result : pending) {
+    result.get();
+  }
+  pending.clear();
+
+  // read one file while another is written over in the middle
+  string first(SIZE, '\0');
+  uint fd = *myfs.open(names[0], ToyFS::R);
+  pending.push_back(myfs.async_read(fd, &first[0], SIZE));
+  string middle(60 * BLOCKSIZE, 'Z');
+  myfs.seek(fds[1], 50 * BLOCKSIZE + 17);
+  pending.push_back(myfs.async_write(fds[1], middle.data(), middle.size()));
+  data[1].replace(50 * BLOCKSIZE + 17, middle.size(), middle);
+  for (auto &result : pending) {
+    result.get();
+  }
+  pending.clear();
+  myfs.close(fd);
+  cout << names[0] << ": " << (first == data[0] ? "read back" : "differs")
+       << '\n';
+  for (uint f = 1; f < FILES; ++f) {
+    myfs.close(fds[f]);
+  }
+
+  vector<string> back(FILES, string(SIZE, '\0'));
+  for (uint f = 0; f < FILES; ++f) {
+    fds[f] = *myfs.open(names[f], ToyFS::R);
+    pending.push_back(myfs.async_read(fds[f], &back[f][0], SIZE));
+  }
+  for (uint f = 0; f < FILES; ++f) {
+    auto n = pending[f].get();
+    myfs.close(fds[f]);
+    cout << names[f] << ": "
+         << (n && *n == SIZE && back[f] == data[f] ? "read back" : "differs")
+         << '\n';
+  }
   return 0;
 }
 
-void repl(const string filename) {
+// an image whose metadata was damaged on disk must be refused, not
+// mounted or reformatted: the first run of the free map is made to start
+// past the end of the disk
+int test_damaged(const string filename, const StorageMode mode,
+                 const bool async_io) {
+  {
+    ToyFS fs(filename, DISKSIZE, BLOCKSIZE, DIRECTBLOCKS, CACHEBLOCKS, mode,
+             true, async_io);
+  }
+  fstream image(filename, fstream::in | fstream::out | fstream::binary);
+  vector<char> block(BLOCKSIZE);
+  image.read(block.data(), block.size());
+  Superblock super;
+  uint32_t meta_run[2];
+  memcpy(&super, block.data(), sizeof(super));
+  memcpy(meta_run, block.data() + sizeof(super), sizeof(meta_run));
+  // the free map comes first: its run count, then (start, length) pairs
+  uint32_t start = super.num_blocks + 100;
+  image.seekp(static_cast<uint64_t>(meta_run[0]) * BLOCKSIZE + 4);
+  image.write(reinterpret_cast<const char *>(&start), sizeof(start));
+  image.close();
+
+  ToyFS myfs(filename, DISKSIZE, BLOCKSIZE, DIRECTBLOCKS, CACHEBLOCKS, mode,
+             false, async_io);
+  cout << "mount: " << fs_strerror(myfs.mount_status()) << '\n';
+  return 0;
+}
+
+typedef void (Shell::*Command)(const vector<string> &args);
+
+const unordered_map<string, Command> COMMANDS = {
+    {"open", &Shell::open},
+    {"read", &Shell::read},
+    {"write", &Shell::write},
+    {"seek", &Shell::seek},
+    {"close", &Shell::close},
+    {"mkdir", &Shell::mkdir},
+    {"rmdir", &Shell::rmdir},
+    {"cd", &Shell::cd},
+    {"link", &Shell::link},
+    {"unlink", &Shell::unlink},
+    {"stat", &Shell::stat},
+    {"ls", &Shell::ls},
+    {"cat", &Shell::cat},
+    {"cp", &Shell::cp},
+    {"tree", &Shell::tree},
+    {"import", &Shell::import},
+    {"export", &Shell::FS_export},
+    {"pwd", &Shell::printwd},
+    {"sync", &Shell::sync},
+    {"df", &Shell::df},
+    {"dcache", &Shell::dcache_stats},
+    {"stats", &Shell::stats},
+    {"compress", &Shell::compress},
+    {"dedup", &Shell::dedup},
+    {"dedupstats", &Shell::dedup_stats},
+    {"scrub", &Shell::scrub},
+};
+
+// split a command line on blanks into args
+void split(const string &cmd, vector<string> *args) {
+    args->clear();
+    size_t pos = 0;
+    while ((pos = cmd.find_first_not_of(" \t", pos)) != string::npos) {
+        size_t end = cmd.find_first_of(" \t", pos);
+        args->push_back(cmd.substr(pos, end - pos));
+        pos = end;
+    }
+}
+
+// write's data is everything between the first pair of quotes, spaces
+// included
+void quote_write(const string &cmd, vector<string> *args) {
+    if (args->size() < 3) {
+        *args = {"write"};
+        return;
+    }
+    auto start = cmd.find("\"");
+    auto end = cmd.find("\"", start+1);
+    if (start != string::npos && end != string::npos) {
+        string w_str = cmd.substr(start+1, end-start-1);
+        auto rn = cmd.find_first_not_of(" \t",end+1);
+        if (rn != string::npos) {
+            *args = {(*args)[0], (*args)[1], w_str, cmd.substr(rn)};
+        } else {
+            *args = {(*args)[0], (*args)[1], w_str};
+        }
+    }
+}
+
+// with a stats_file, commands are measured from the start and the
+// stats are written to it on exit. In batch mode there is no prompt,
+// output is flushed only when the buffer fills, and a summary of the
+// run goes to stderr at the end. Returns the exit status.
+int repl(const string filename, const StorageMode mode, const bool async_io,
+          const string stats_file, const bool batch, const bool compress,
+          const bool dedup) {
 
-  ToyFS *fs = new ToyFS(filename, DISKSIZE, BLOCKSIZE, DIRECTBLOCKS);
+  ToyFS *fs = new ToyFS(filename, DISKSIZE, BLOCKSIZE, DIRECTBLOCKS, CACHEBLOCKS, mode,
+                        false, async_io);
+  if (fs->mount_status() != FS_OK) {
+    cerr << "error: " << filename << ": " << fs_strerror(fs->mount_status())
+         << endl;
+    delete(fs);
+    return 1;
+  }
+  fs->set_compression(compress);
+  fs->set_dedup(dedup);
+  Shell *sh = new Shell(*fs);
+  if (!stats_file.empty()) {
+    sh->stats({"stats", "on"});
+  }
 
     string cmd;
     vector<string> args;
-    string token;
+    uint64_t commands = 0;
+    auto start = std::chrono::steady_clock::now();
+    const string prompt = batch ? "" : PRMPT;
 
-    cout << PRMPT;
+    cout << prompt;
     while (getline(cin, cmd)) {
-        args.clear();
-        istringstream iss(cmd);
-        while (iss >> token) { args.push_back(token); }
+        split(cmd, &args);
         if (args.size() == 0) {
-            cout << PRMPT;
+            cout << prompt;
             continue;
         }
+        if (args[0] == "exit") {
+            break;
+        }
+        ++commands;
 
         if (args[0] == "mkfs") {
             if (args.size() == 1) {
+                delete(sh);
                 delete(fs);
-                fs = new ToyFS(filename, DISKSIZE, BLOCKSIZE, DIRECTBLOCKS);
+                fs = new ToyFS(filename, DISKSIZE, BLOCKSIZE, DIRECTBLOCKS,
+                               CACHEBLOCKS, mode, true, async_io);
+                if (fs->mount_status() != FS_OK) {
+                    cerr << "error: " << filename << ": "
+                         << fs_strerror(fs->mount_status()) << endl;
+                    delete(fs);
+                    return 1;
+                }
+                fs->set_compression(compress);
+                fs->set_dedup(dedup);
+                sh = new Shell(*fs);
+                if (!stats_file.empty()) {
+                    sh->stats({"stats", "on"});
+                }
             } else {
                 cerr << "mkfs: too many operands" << endl;
             }
-        } else if (args[0] == "open") {
-            fs->open(args);
-        } else if (args[0] == "read") {
-            fs->read(args);
-        } else if (args[0] == "write") {
-            if(args.size() >= 3) {
-              auto start = cmd.find("\"");
-              auto end = cmd.find("\"", start+1);
-              if (start != string::npos && end != string::npos) {
-                string w_str = cmd.substr(start+1, end-start-1);
-                auto rn = cmd.find_first_not_of(" \t",end+1);
-                if (rn != string::npos) {
-                  args = {args[0], args[1], w_str, cmd.substr(rn)};
-                } else {
-                  args = {args[0], args[1], w_str};
-                }
-              }
+        } else {
+            auto command = COMMANDS.find(args[0]);
+            if (command == COMMANDS.end()) {
+                cout << "unknown command: " << args[0] << '\n';
             } else {
-              args = {"write"};
+                if (args[0] == "write") {
+                    quote_write(cmd, &args);
+                }
+                (sh->*command->second)(args);
             }
-            fs->write(args);
-        } else if (args[0] == "seek") {
-            fs->seek(args);
-        } else if (args[0] == "close") {
-            fs->close(args);
-        } else if (args[0] == "mkdir") {
-            fs->mkdir(args);
-        } else if (args[0] == "rmdir") {
-            fs->rmdir(args);
-        } else if (args[0] == "cd") {
-            fs->cd(args);
-        } else if (args[0] == "link") {
-            fs->link(args);
-        } else if (args[0] == "unlink") {
-            fs->unlink(args);
-        } else if (args[0] == "stat") {
-            fs->stat(args);
-        } else if (args[0] == "ls") {
-            fs->ls(args);
-        } else if (args[0] == "cat") {
-            fs->cat(args);
-        } else if (args[0] == "cp") {
-            fs->cp(args);
-        } else if (args[0] == "tree") {
-            fs->tree(args);
-        } else if (args[0] == "import") {
-            fs->import(args);
-        } else if (args[0] == "export") {
-            fs->FS_export(args);
-        } else if (args[0] == "exit") {
-            break;
-        } else if (args[0] == "pwd") {
-            fs->printwd(args);
-        } else {
-            cout << "unknown command: " << args[0] << endl;
         }
-        cout << PRMPT;
+        cout << prompt;
     }
 
+    if (batch) {
+        cout.flush();
+        double seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+        cerr << "batch: " << commands << " commands in " << fixed
+             << setprecision(3) << seconds << " s ("
+             << setprecision(0) << commands / std::max(seconds, 1e-9)
+             << " commands/s)" << endl;
+    }
+    if (!stats_file.empty()) {
+        sh->stats({"stats", "dump", stats_file});
+    }
+    delete(sh);
     delete(fs);
-    return;
+    return 0;
 }
 
 int main(int argc, char **argv) {
-    if (argc != 2) {
-        cerr << "usage: " << argv[0] << " filename" << endl;
+    StorageMode mode = file_mode;
+    bool async_io = false;
+    bool compress = false;
+    bool dedup = false;
+    string stats_file;
+    // no prompts when the commands don't come from a terminal
+    bool batch = !isatty(STDIN_FILENO);
+    int arg = 1;
+    for (; arg < argc - 1; ++arg) {
+        if (string(argv[arg]) == "-m") {
+            mode = mmap_mode;
+        } else if (string(argv[arg]) == "-a") {
+            async_io = true;
+        } else if (string(argv[arg]) == "-b") {
+            batch = true;
+        } else if (string(argv[arg]) == "-z") {
+            compress = true;
+        } else if (string(argv[arg]) == "-d") {
+            dedup = true;
+        } else if (string(argv[arg]) == "-s" && arg < argc - 2) {
+            stats_file = argv[++arg];
+        } else {
+            break;
+        }
+    }
+    if (arg != argc - 1) {
+        cerr << "usage: " << argv[0] << " [-m] [-a] [-b] [-z] [-d] [-s statsfile] filename" << endl;
         return 1;
     }
+    string filename(argv[argc - 1]);
 
 #ifdef DEBUG
-    test_fs(string(argv[1]));
+    (void) batch;
+    (void) compress;
+    (void) dedup;
+    test_fs(filename, mode, async_io);
+    test_replay(filename, mode, async_io);
+    test_async(filename, mode, async_io);
+    test_damaged(filename, mode, async_io);
 #else
-    repl(string(argv[1]));
+    if (batch) {
+        std::ios::sync_with_stdio(false);
+    }
+    return repl(filename, mode, async_io, stats_file, batch, compress, dedup);
 #endif
     return 0;
 }
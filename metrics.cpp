@@ -0,0 +1,131 @@
+#include "metrics.hpp"
+#include <iomanip>
+
+using std::memory_order_relaxed;
+using std::ostream;
+using std::setw;
+
+thread_local Metrics::OpStats *Metrics::current = nullptr;
+
+static const char *const OP_NAMES[Metrics::NUM_OPS] = {
+  "open", "read", "write", "seek", "close", "mkdir", "rmdir", "cd", "link",
+  "unlink", "stat", "ls", "cat", "cp", "tree", "import", "export", "pwd", "df",
+  "sync", "dcache", "dedup", "scrub"
+};
+
+static const char *const COUNTER_NAMES[Metrics::NUM_COUNTERS] = {
+  "bytes_read", "bytes_written", "blocks_allocated", "blocks_freed", "seeks"
+};
+
+Metrics::Metrics() {
+  reset();
+}
+
+Metrics::Scope::Scope(Metrics &metrics, Op op) {
+  if (!metrics.enabled.load(memory_order_relaxed) || current != nullptr) {
+    return;
+  }
+  stats = &metrics.ops[op];
+  current = stats;
+  start = std::chrono::steady_clock::now();
+}
+
+Metrics::Scope::~Scope() {
+  if (stats == nullptr) {
+    return;
+  }
+  uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start).count();
+  uint bucket = 0;
+  for (uint64_t us = ns / 1000; us > 0 && bucket < BUCKETS - 1; us >>= 1) {
+    ++bucket;
+  }
+  stats->calls.fetch_add(1, memory_order_relaxed);
+  stats->total_ns.fetch_add(ns, memory_order_relaxed);
+  stats->histogram[bucket].fetch_add(1, memory_order_relaxed);
+  current = nullptr;
+}
+
+void Metrics::reset() {
+  for (auto &stats : ops) {
+    stats.calls = 0;
+    stats.total_ns = 0;
+    for (auto &counter : stats.counters) {
+      counter = 0;
+    }
+    for (auto &bucket : stats.histogram) {
+      bucket = 0;
+    }
+  }
+}
+
+uint64_t Metrics::percentile(Op op, double p) const {
+  const OpStats &stats = ops[op];
+  uint64_t calls = 0;
+  for (auto &bucket : stats.histogram) {
+    calls += bucket;
+  }
+  uint64_t seen = 0;
+  for (uint i = 0; i < BUCKETS; ++i) {
+    seen += stats.histogram[i];
+    if (seen > 0 && seen >= p * calls) {
+      return 1ULL << i;
+    }
+  }
+  return 1ULL << (BUCKETS - 1);
+}
+
+void Metrics::print(ostream &out) const {
+  out << "stats: " << (enabled ? "on" : "off") << '\n';
+  out << "command    calls   avg us   p50 us   p99 us        read     written"
+      << "    alloc    freed    seeks" << '\n';
+  for (uint op = 0; op < NUM_OPS; ++op) {
+    const OpStats &stats = ops[op];
+    uint64_t calls = stats.calls;
+    if (calls == 0) {
+      continue;
+    }
+    out << std::left << setw(7) << OP_NAMES[op] << std::right << setw(9)
+        << calls << setw(9) << stats.total_ns / calls / 1000 << setw(9)
+        << percentile(Op(op), 0.5) << setw(9) << percentile(Op(op), 0.99);
+    for (uint c = 0; c < NUM_COUNTERS; ++c) {
+      out << setw(c < BLOCKS_ALLOCATED ? 12 : 9) << stats.counters[c];
+    }
+    out << '\n';
+  }
+  for (uint op = 0; op < NUM_OPS; ++op) {
+    const OpStats &stats = ops[op];
+    if (stats.calls == 0) {
+      continue;
+    }
+    out << OP_NAMES[op] << ":";
+    for (uint i = 0; i < BUCKETS; ++i) {
+      if (stats.histogram[i] > 0) {
+        out << " <" << (1ULL << i) << "us " << stats.histogram[i];
+      }
+    }
+    out << '\n';
+  }
+}
+
+void Metrics::dump(ostream &out) const {
+  out << "command,calls,total_ns";
+  for (auto name : COUNTER_NAMES) {
+    out << "," << name;
+  }
+  for (uint i = 0; i < BUCKETS; ++i) {
+    out << ",lt" << (1ULL << i) << "us";
+  }
+  out << '\n';
+  for (uint op = 0; op < NUM_OPS; ++op) {
+    const OpStats &stats = ops[op];
+    out << OP_NAMES[op] << "," << stats.calls << "," << stats.total_ns;
+    for (auto &counter : stats.counters) {
+      out << "," << counter;
+    }
+    for (auto &bucket : stats.histogram) {
+      out << "," << bucket;
+    }
+    out << '\n';
+  }
+}
@@ -0,0 +1,78 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <sys/types.h>
+
+// Per-command counters and latency histograms. Each ToyFS command opens
+// a Scope while it runs; while the scope is open, the work it does below
+// (bytes read and written, blocks allocated and freed, disk seeks) is
+// charged to that command through count, wherever in the code it
+// happens. A command run by another one, like the read done by cat, is
+// charged to the outer command.
+//
+// Measuring is off until enabled; then a scope is one relaxed load and
+// count is one thread local test.
+class Metrics {
+ public:
+  enum Op {
+    OPEN, READ, WRITE, SEEK, CLOSE, MKDIR, RMDIR, CD, LINK, UNLINK, STAT, LS,
+    CAT, CP, TREE, IMPORT, EXPORT, PWD, DF, SYNC, DCACHE, DEDUP,
+    SCRUB, NUM_OPS
+  };
+  enum Counter {
+    BYTES_READ, BYTES_WRITTEN, BLOCKS_ALLOCATED, BLOCKS_FREED, SEEKS,
+    NUM_COUNTERS
+  };
+  // bucket i counts calls that took less than 2^i microseconds (and at
+  // least half that); the last one takes everything slower
+  static const uint BUCKETS = 32;
+
+ private:
+  struct OpStats {
+    std::atomic<uint64_t> calls;
+    std::atomic<uint64_t> total_ns;
+    std::atomic<uint64_t> counters[NUM_COUNTERS];
+    std::atomic<uint64_t> histogram[BUCKETS];
+  };
+
+  OpStats ops[NUM_OPS];
+  // the stats of the command running on this thread, if it is measured
+  static thread_local OpStats *current;
+
+  // a latency percentile of op, as the upper bound of its bucket
+  uint64_t percentile(Op op, double p) const;
+
+ public:
+  std::atomic<bool> enabled{false};
+
+  Metrics();
+
+  class Scope {
+    OpStats *stats = nullptr;
+    std::chrono::steady_clock::time_point start;
+   public:
+    Scope(Metrics &metrics, Op op);
+    ~Scope();
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+  };
+
+  static void count(Counter counter, uint64_t n) {
+    if (current != nullptr) {
+      current->counters[counter].fetch_add(n, std::memory_order_relaxed);
+    }
+  }
+
+  void reset();
+  // a table of the commands that have been called, then their
+  // histograms; percentiles are given as the bound of their bucket
+  void print(std::ostream &out) const;
+  // the same as CSV, one line per command, with every bucket
+  void dump(std::ostream &out) const;
+};
+
+#endif /* _METRICS_H_ */
@@ -0,0 +1,205 @@
+#include "ondisk.hpp"
+#include <cstring>
+#include <fstream>
+
+using std::ifstream;
+using std::string;
+
+bool Superblock::probe(const string &filename, Superblock *super) {
+  ifstream in(filename, ifstream::binary);
+  if (!in.is_open()) {
+    return false;
+  }
+  in.read(reinterpret_cast<char *>(super), sizeof(Superblock));
+  return in.gcount() == sizeof(Superblock) && super->magic == TOYFS_MAGIC;
+}
+
+bool Superblock::usable() const {
+  return magic == TOYFS_MAGIC &&
+      version >= 1 && version <= TOYFS_VERSION &&
+      block_size >= sizeof(Superblock) &&
+      num_blocks > 0;
+}
+
+uint Superblock::max_meta_runs(uint block_size) {
+  return (block_size - sizeof(Superblock)) / (2 * sizeof(uint32_t));
+}
+
+void MetaWriter::u32(uint32_t value) {
+  buf.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+void MetaWriter::str(const string &value) {
+  u32(value.size());
+  buf.append(value);
+}
+
+bool MetaReader::u8(uint8_t *value) {
+  if (pos + 1 > buf.size()) {
+    return false;
+  }
+  *value = buf[pos++];
+  return true;
+}
+
+bool MetaReader::u32(uint32_t *value) {
+  if (pos + sizeof(*value) > buf.size()) {
+    return false;
+  }
+  memcpy(value, buf.data() + pos, sizeof(*value));
+  pos += sizeof(*value);
+  return true;
+}
+
+bool MetaReader::str(string *value) {
+  uint32_t len;
+  if (!u32(&len) || pos + len > buf.size()) {
+    return false;
+  }
+  value->assign(buf, pos, len);
+  pos += len;
+  return true;
+}
+
+// CRC-32C is computed with the SSE4.2 crc32 instruction where the CPU
+// has it, and with tables otherwise.
+const uint32_t CRC32C_POLY = 0x82f63b78;  // reflected Castagnoli polynomial
+// the hardware version runs three streams of this many bytes at once
+const size_t CRC_STRIPE = 256;
+
+// slicing-by-8 tables: entries[k][b] is the CRC of byte b followed by k
+// zero bytes
+struct Crc32cTable {
+  uint32_t entries[8][256];
+  Crc32cTable() {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; ++k) {
+        c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+      }
+      entries[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; ++i) {
+      for (int k = 1; k < 8; ++k) {
+        uint32_t c = entries[k - 1][i];
+        entries[k][i] = entries[0][c & 0xff] ^ (c >> 8);
+      }
+    }
+  }
+};
+
+static const Crc32cTable table;
+
+static uint32_t crc32c_portable(const char *data, size_t len, uint32_t crc) {
+  const auto &t = table.entries;
+  for (; len >= 8; data += 8, len -= 8) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    word ^= crc;
+    crc = t[7][word & 0xff] ^ t[6][(word >> 8) & 0xff] ^
+        t[5][(word >> 16) & 0xff] ^ t[4][(word >> 24) & 0xff] ^
+        t[3][(word >> 32) & 0xff] ^ t[2][(word >> 40) & 0xff] ^
+        t[1][(word >> 48) & 0xff] ^ t[0][word >> 56];
+  }
+  for (; len > 0; ++data, --len) {
+    crc = t[0][(crc ^ static_cast<uint8_t>(*data)) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+// Running CRC_STRIPE zero bytes through the CRC register is linear, so
+// it can be looked up a byte of the register at a time, like the CRC
+// itself. That is what joins the three streams back together.
+struct Crc32cShift {
+  uint32_t entries[4][256];
+
+  // apply the 32x32 bit matrix mat to vec
+  static uint32_t times(const uint32_t *mat, uint32_t vec) {
+    uint32_t sum = 0;
+    for (; vec != 0; vec >>= 1, ++mat) {
+      if (vec & 1) {
+        sum ^= *mat;
+      }
+    }
+    return sum;
+  }
+  static void square(uint32_t *out, const uint32_t *mat) {
+    for (int n = 0; n < 32; ++n) {
+      out[n] = times(mat, mat[n]);
+    }
+  }
+
+  Crc32cShift() {
+    // the operator for one zero bit, squared up to CRC_STRIPE bytes
+    uint32_t op[32], next[32];
+    op[0] = CRC32C_POLY;
+    for (int n = 1; n < 32; ++n) {
+      op[n] = 1u << (n - 1);
+    }
+    for (size_t bits = 1; bits < 8 * CRC_STRIPE; bits *= 2) {
+      square(next, op);
+      memcpy(op, next, sizeof(op));
+    }
+    for (uint32_t b = 0; b < 256; ++b) {
+      for (int k = 0; k < 4; ++k) {
+        entries[k][b] = times(op, b << (8 * k));
+      }
+    }
+  }
+
+  uint32_t operator()(uint32_t crc) const {
+    return entries[0][crc & 0xff] ^ entries[1][(crc >> 8) & 0xff] ^
+        entries[2][(crc >> 16) & 0xff] ^ entries[3][crc >> 24];
+  }
+};
+
+static const Crc32cShift shift;
+
+// each crc32 instruction waits for the one before, so three independent
+// streams keep the unit busy
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(const char *data, size_t len, uint32_t crc) {
+  uint64_t crc0 = crc;
+  for (; len > 0 && reinterpret_cast<uintptr_t>(data) % 8 != 0; ++data, --len) {
+    crc0 = __builtin_ia32_crc32qi(crc0, *data);
+  }
+  auto word = [] (const char *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+  };
+  for (; len >= 3 * CRC_STRIPE; data += 3 * CRC_STRIPE, len -= 3 * CRC_STRIPE) {
+    uint64_t crc1 = 0, crc2 = 0;
+    for (size_t i = 0; i < CRC_STRIPE; i += 8) {
+      crc0 = __builtin_ia32_crc32di(crc0, word(data + i));
+      crc1 = __builtin_ia32_crc32di(crc1, word(data + CRC_STRIPE + i));
+      crc2 = __builtin_ia32_crc32di(crc2, word(data + 2 * CRC_STRIPE + i));
+    }
+    crc0 = shift(crc0) ^ crc1;
+    crc0 = shift(crc0) ^ crc2;
+  }
+  for (; len >= 8; data += 8, len -= 8) {
+    crc0 = __builtin_ia32_crc32di(crc0, word(data));
+  }
+  for (; len > 0; ++data, --len) {
+    crc0 = __builtin_ia32_crc32qi(crc0, *data);
+  }
+  return crc0;
+}
+
+static bool have_sse42() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse4.2");
+}
+#endif
+
+uint32_t crc32c(const char *data, size_t len, uint32_t crc) {
+#if defined(__x86_64__)
+  static const bool hardware = have_sse42();
+  if (hardware) {
+    return ~crc32c_sse42(data, len, ~crc);
+  }
+#endif
+  return ~crc32c_portable(data, len, ~crc);
+}
@@ -0,0 +1,71 @@
+#ifndef _ONDISK_H_
+#define _ONDISK_H_
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+#include <sys/types.h>
+
+// On-disk layout of an image:
+//
+//   block 0        superblock: geometry and where the metadata lives
+//   metadata runs  free-space map, shared block counts, journal location,
+//                  inode table and directory tree, serialized by
+//                  ToyFS::checkpoint into blocks taken from the
+//                  allocator like any file's
+//   journal        log of the changes made since the last checkpoint
+//   everything else  file data
+//
+// Integers are stored in host byte order.
+
+const uint64_t TOYFS_MAGIC = 0x31736673796f74ULL;  // "toyfs1\0"
+// version 2 added reference counts for blocks shared by copies, version 3
+// the journal, version 4 inline data for small files, version 5
+// compressed files and version 6 checksums of file data
+const uint32_t TOYFS_VERSION = 6;
+
+struct Superblock {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t block_size;
+  uint32_t num_blocks;
+  uint32_t direct_blocks;
+  // length of the serialized metadata and the runs of blocks holding it
+  uint32_t meta_bytes;
+  uint32_t meta_run_count;
+  // followed by meta_run_count (start block, length) pairs
+
+  // read the superblock and geometry of an existing image; false if
+  // filename is missing or doesn't start with the toyfs magic
+  static bool probe(const std::string &filename, Superblock *super);
+  // whether this version of toyfs can mount an image with this superblock
+  bool usable() const;
+  // how many metadata runs fit alongside the superblock
+  static uint max_meta_runs(uint block_size);
+};
+
+// Appends fixed-width fields to a byte buffer
+class MetaWriter {
+ public:
+  std::string buf;
+  void u8(uint8_t value) { buf.push_back(value); }
+  void u32(uint32_t value);
+  void str(const std::string &value);
+};
+
+// Reads fields back; every accessor returns false once the data runs out
+class MetaReader {
+  const std::string &buf;
+  size_t pos = 0;
+ public:
+  explicit MetaReader(const std::string &buf) : buf(buf) {}
+  bool u8(uint8_t *value);
+  bool u32(uint32_t *value);
+  bool str(std::string *value);
+};
+
+// CRC-32C (Castagnoli) of len bytes, continuing from crc
+uint32_t crc32c(const char *data, size_t len, uint32_t crc = 0);
+
+#endif /* _ONDISK_H_ */
@@ -0,0 +1,47 @@
+#ifndef _SHAREDMUTEX_H_
+#define _SHAREDMUTEX_H_
+
+#include <condition_variable>
+#include <mutex>
+#include <sys/types.h>
+
+// A readers-writer lock: any number of threads can hold it shared, or one
+// thread exclusively. A waiting writer holds back new readers so it
+// can't be starved. Not recursive either way.
+class SharedMutex {
+  std::mutex mutex;
+  std::condition_variable changed;
+  uint readers = 0;
+  uint writers_waiting = 0;
+  bool writer = false;
+
+ public:
+  void lock() {
+    std::unique_lock<std::mutex> guard(mutex);
+    ++writers_waiting;
+    changed.wait(guard, [this] () {return !writer && readers == 0;});
+    --writers_waiting;
+    writer = true;
+  }
+
+  void unlock() {
+    std::lock_guard<std::mutex> guard(mutex);
+    writer = false;
+    changed.notify_all();
+  }
+
+  void lock_shared() {
+    std::unique_lock<std::mutex> guard(mutex);
+    changed.wait(guard, [this] () {return !writer && writers_waiting == 0;});
+    ++readers;
+  }
+
+  void unlock_shared() {
+    std::lock_guard<std::mutex> guard(mutex);
+    if (--readers == 0) {
+      changed.notify_all();
+    }
+  }
+};
+
+#endif /* _SHAREDMUTEX_H_ */
@@ -0,0 +1,482 @@
+#include "shell.hpp"
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::fixed;
+using std::ios;
+using std::istringstream;
+using std::ofstream;
+using std::setprecision;
+using std::string;
+using std::vector;
+
+#define ops_at_least(x)                                 \
+  if (static_cast<int>(args.size()) < x+1) {            \
+    cerr << args[0] << ": missing operand" << endl;     \
+    return;                                             \
+  }
+
+#define ops_less_than(x)                                \
+  if (static_cast<int>(args.size()) > x+1) {            \
+    cerr << args[0] << ": too many operands" << endl;   \
+    return;                                             \
+  }
+
+#define ops_exactly(x)                          \
+  ops_at_least(x);                              \
+  ops_less_than(x);
+
+// print why cmd failed on arg
+static void report(const string &cmd, const string &arg, FsError error) {
+  cerr << cmd << ": error: ";
+  switch (error) {
+    case FS_INVALID_PATH:
+      cerr << "Invalid path: " << arg;
+      break;
+    case FS_NOT_FOUND:
+      cerr << arg << " does not exist.";
+      break;
+    case FS_EXISTS:
+      cerr << arg << " already exists.";
+      break;
+    case FS_NOT_FILE:
+      cerr << arg << " must be a file.";
+      break;
+    case FS_NOT_DIR:
+      cerr << arg << " must be a directory.";
+      break;
+    case FS_IS_ROOT:
+      cerr << "Cannot " << cmd << " root.";
+      break;
+    case FS_IS_CWD:
+      cerr << "Cannot remove working directory.";
+      break;
+    case FS_NOT_EMPTY:
+      cerr << "Directory not empty.";
+      break;
+    case FS_BUSY:
+      cerr << arg << " is open.";
+      break;
+    case FS_BAD_FD:
+      cerr << "File descriptor not open.";
+      break;
+    case FS_BAD_MODE:
+      cerr << arg << " not open for " << cmd << ".";
+      break;
+    case FS_PAST_END:
+      cerr << (cmd == "seek" ? "Position outside file."
+                             : "Read goes beyond file end.");
+      break;
+    case FS_TOO_LARGE:
+      cerr << "File too large for inode.";
+      break;
+    case FS_NO_SPACE:
+      cerr << "Insufficient disk space.";
+      break;
+    case FS_SAME_DIR:
+      cerr << "src and dest must be in different directories.";
+      break;
+    case FS_HOST_IO:
+      cerr << "Unable to open " << arg;
+      break;
+    default:
+      cerr << fs_strerror(error);
+  }
+  cerr << endl;
+}
+
+// the same for a failed read, naming the block a checksum mismatch was
+// found in
+static void report(const string &cmd, const string &arg,
+                   const Result<uint> &result) {
+  if (result.error() == FS_CORRUPT) {
+    cerr << cmd << ": error: Checksum mismatch at block " << *result << endl;
+  } else {
+    report(cmd, arg, result.error());
+  }
+}
+
+static bool parse_uint(const string &text, uint *value) {
+  return static_cast<bool>(istringstream(text) >> *value);
+}
+
+static bool parse_mode(const string &text, ToyFS::Mode *mode) {
+  if (text == "w") {
+    *mode = ToyFS::W;
+  } else if (text == "r") {
+    *mode = ToyFS::R;
+  } else if (text == "rw") {
+    *mode = ToyFS::RW;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void Shell::open(const vector<string> &args) {
+  ops_exactly(2);
+
+  ToyFS::Mode mode;
+  if (!parse_mode(args[2], &mode)) {
+    cerr << args[0] << ": error: Unknown mode: " << args[2] << endl;
+    return;
+  }
+  auto fd = fs.open(args[1], mode);
+  if (!fd) {
+    report(args[0], args[1], fd.error());
+  } else {
+    cout << "SUCCESS: fd=" << *fd << '\n';
+  }
+}
+
+void Shell::read(const vector<string> &args) {
+  ops_exactly(2);
+
+  uint fd, size;
+  if (!parse_uint(args[1], &fd)) {
+    cerr << "read: error: Unknown descriptor." << endl;
+  } else if (!parse_uint(args[2], &size)) {
+    cerr << "read: error: Invalid read size." << endl;
+  } else {
+    string data(size, '\0');
+    auto n = fs.read(fd, &data[0], size);
+    if (!n) {
+      report(args[0], args[1], n);
+    } else {
+      cout << data << '\n';
+    }
+  }
+}
+
+void Shell::write(const vector<string> &args) {
+  ops_exactly(2);
+
+  uint fd;
+  if (!parse_uint(args[1], &fd)) {
+    cerr << "write: error: Unknown descriptor." << endl;
+    return;
+  }
+  auto n = fs.write(fd, args[2].data(), args[2].size());
+  if (!n) {
+    report(args[0], args[1], n.error());
+  }
+}
+
+void Shell::seek(const vector<string> &args) {
+  ops_exactly(2);
+
+  uint fd, pos;
+  if (!parse_uint(args[1], &fd)) {
+    cerr << "seek: error: Unknown descriptor." << endl;
+  } else if (!parse_uint(args[2], &pos)) {
+    cerr << "seek: error: Invalid position." << endl;
+  } else {
+    FsError error = fs.seek(fd, pos);
+    if (error != FS_OK) {
+      report(args[0], args[1], error);
+    }
+  }
+}
+
+void Shell::close(const vector<string> &args) {
+  ops_exactly(1);
+
+  uint fd;
+  if (!parse_uint(args[1], &fd)) {
+    cerr << "close: error: File descriptor not recognized" << endl;
+  } else if (fs.close(fd) != FS_OK) {
+    cerr << "close: error: File descriptor not open" << endl;
+  } else {
+    cout << "closed " << fd << '\n';
+  }
+}
+
+void Shell::mkdir(const vector<string> &args) {
+  ops_at_least(1);
+
+  /* add each new directory one at a time */
+  for (uint i = 1; i < args.size(); i++) {
+    FsError error = fs.mkdir(args[i]);
+    if (error != FS_OK) {
+      report(args[0], args[i], error);
+      if (error != FS_EXISTS) {
+        return;
+      }
+    }
+  }
+}
+
+void Shell::rmdir(const vector<string> &args) {
+  ops_at_least(1);
+
+  for (uint i = 1; i < args.size(); i++) {
+    FsError error = fs.rmdir(args[i]);
+    if (error != FS_OK) {
+      report(args[0], args[i], error);
+    }
+  }
+}
+
+void Shell::printwd(const vector<string> &args) {
+  ops_exactly(0);
+
+  cout << fs.cwd() << '\n';
+}
+
+void Shell::cd(const vector<string> &args) {
+  ops_exactly(1);
+
+  FsError error = fs.cd(args[1]);
+  if (error != FS_OK) {
+    report(args[0], args[1], error);
+  }
+}
+
+void Shell::link(const vector<string> &args) {
+  ops_exactly(2);
+
+  FsError error = fs.link(args[1], args[2]);
+  if (error != FS_OK) {
+    // only the destination can already exist
+    report(args[0], error == FS_EXISTS ? args[2] : args[1], error);
+  }
+}
+
+void Shell::unlink(const vector<string> &args) {
+  ops_exactly(1);
+
+  FsError error = fs.unlink(args[1]);
+  if (error != FS_OK) {
+    report(args[0], args[1], error);
+  }
+}
+
+void Shell::stat(const vector<string> &args) {
+  ops_at_least(1);
+
+  for (uint i = 1; i < args.size(); i++) {
+    auto info = fs.stat(args[i]);
+    if (!info) {
+      report(args[0], args[i], info.error());
+      continue;
+    }
+    cout << "  File: " << info->name << '\n';
+    if (info->type == file) {
+      cout << "  Type: file" << (info->compressed ? " (compressed)" : "")
+           << '\n';
+      cout << " Inode: " << reinterpret_cast<const void *>(info->inode) << '\n';
+      cout << " Links: " << info->links << '\n';
+      cout << "  Size: " << info->size << '\n';
+      cout << " Alloc: " << info->allocated << '\n';
+      cout << "Blocks: " << info->blocks << '\n';
+    } else {
+      cout << "  Type: directory" << '\n';
+    }
+  }
+}
+
+void Shell::ls(const vector<string> &args) {
+  ops_exactly(0);
+
+  auto entries = fs.list();
+  for (auto &entry : *entries) {
+    cout << entry.name << '\n';
+  }
+}
+
+void Shell::cat(const vector<string> &args) {
+  ops_at_least(1);
+  Metrics::Scope measure(fs.metrics, Metrics::CAT);
+
+  for (uint i = 1; i < args.size(); i++) {
+    auto fd = fs.open(args[i], ToyFS::R);
+    if (!fd) {
+      report(args[0], args[i], fd.error());
+      continue;
+    }
+    string data(fs.fstat(*fd)->size, '\0');
+    auto n = fs.read(*fd, &data[0], data.size());
+    if (!n) {
+      report(args[0], args[i], n);
+    } else {
+      cout << data << '\n';
+    }
+    fs.close(*fd);
+  }
+}
+
+void Shell::cp(const vector<string> &args) {
+  ops_exactly(2);
+
+  FsError error = fs.cp(args[1], args[2]);
+  if (error != FS_OK) {
+    // a missing source is the only reason it can't be found
+    report(args[0], error == FS_NOT_FOUND ? args[1] : args[2], error);
+  }
+}
+
+static void tree_helper(ToyFS &fs, const ToyFS::FileInfo &info,
+                        const string &path, const string &indent) {
+  if (info.type == file) {
+    cout << info.name << ": " << info.size << " bytes" << '\n';
+    return;
+  }
+  cout << info.name << '\n';
+  auto cont = fs.list(path);
+  if (!cont || cont->empty()) return;
+
+  for (size_t i = 0; i + 1 < cont->size(); ++i) {
+    auto &entry = (*cont)[i];
+    cout << indent << "├───";
+    tree_helper(fs, entry, path + "/" + entry.name, indent + "│   ");
+  }
+
+  auto &last = cont->back();
+  cout << indent << "└───";
+  tree_helper(fs, last, path + "/" + last.name, indent + "    ");
+}
+
+void Shell::tree(const vector<string> &args) {
+  ops_exactly(0);
+  Metrics::Scope measure(fs.metrics, Metrics::TREE);
+
+  tree_helper(fs, *fs.stat("."), ".", "");
+}
+
+void Shell::import(const vector<string> &args) {
+  ops_exactly(2);
+
+  FsError error = fs.import(args[1], args[2]);
+  if (error == FS_NO_SPACE) {
+    cerr << args[0] << ": error: out of free space or file too large" << endl;
+  } else if (error != FS_OK) {
+    report(args[0], error == FS_HOST_IO ? args[1] : args[2], error);
+  }
+}
+
+void Shell::FS_export(const vector<string> &args) {
+  ops_exactly(2);
+
+  auto n = fs.export_file(args[1], args[2]);
+  if (!n) {
+    report(args[0], n.error() == FS_HOST_IO ? args[2] : args[1], n);
+  }
+}
+
+void Shell::dcache_stats(const vector<string> &args) {
+  ops_exactly(0);
+
+  auto info = fs.dcache_stats();
+  cout << "dcache: " << info.entries << " entries, "
+       << info.hits << " hits, " << info.misses << " misses" << '\n';
+}
+
+void Shell::df(const vector<string> &args) {
+  ops_exactly(0);
+
+  auto info = fs.df();
+  cout << "   Blocks: " << info.total << '\n';
+  cout << "     Used: " << info.total - info.free << '\n';
+  cout << "     Free: " << info.free << '\n';
+  cout << "  Largest: " << info.largest << '\n';
+  cout << "  Extents: " << info.extents << '\n';
+  cout << "   Shared: " << info.shared << '\n';
+  cout << "Fragments: " << fixed << setprecision(1)
+       << 100 * info.fragmentation << "%" << '\n';
+  cout.unsetf(ios::floatfield);
+}
+
+void Shell::sync(const vector<string> &args) {
+  ops_exactly(0);
+
+  auto info = fs.sync();
+  cout << "sync: wrote back " << info.written_back << " blocks ("
+       << info.cached << " cached, " << info.hits << " hits, "
+       << info.misses << " misses, " << info.prefetched << " read ahead)"
+       << '\n';
+}
+
+void Shell::stats(const vector<string> &args) {
+  ops_less_than(2);
+
+  Metrics &metrics = fs.metrics;
+  if (args.size() == 1) {
+    metrics.print(cout);
+  } else if (args[1] == "on" || args[1] == "off") {
+    ops_exactly(1);
+    metrics.enabled = args[1] == "on";
+    cout << "stats: " << args[1] << '\n';
+  } else if (args[1] == "reset") {
+    ops_exactly(1);
+    metrics.reset();
+  } else if (args[1] == "dump") {
+    ops_exactly(2);
+    ofstream out(args[2]);
+    if (!out.is_open()) {
+      cerr << args[0] << ": error: Unable to open " << args[2] << endl;
+      return;
+    }
+    metrics.dump(out);
+  } else {
+    cerr << args[0] << ": error: Unknown option: " << args[1] << endl;
+  }
+}
+
+void Shell::compress(const vector<string> &args) {
+  ops_less_than(1);
+
+  if (args.size() == 2) {
+    if (args[1] != "on" && args[1] != "off") {
+      cerr << args[0] << ": error: Unknown option: " << args[1] << endl;
+      return;
+    }
+    fs.set_compression(args[1] == "on");
+  }
+  cout << "compress: " << (fs.compression() ? "on" : "off") << '\n';
+}
+
+void Shell::dedup(const vector<string> &args) {
+  ops_less_than(1);
+
+  if (args.size() == 2) {
+    if (args[1] != "on" && args[1] != "off") {
+      cerr << args[0] << ": error: Unknown option: " << args[1] << endl;
+      return;
+    }
+    fs.set_dedup(args[1] == "on");
+  }
+  cout << "dedup: " << (fs.deduplication() ? "on" : "off") << '\n';
+}
+
+void Shell::scrub(const vector<string> &args) {
+  ops_exactly(0);
+
+  auto info = fs.scrub();
+  for (uint block : info.corrupt) {
+    cerr << args[0] << ": error: Checksum mismatch at block " << block << endl;
+  }
+  double mb = info.bytes / 1e6;
+  cout << "scrub: " << info.blocks << " blocks checked, " << info.corrupt.size()
+       << " corrupt, in " << fixed << setprecision(3) << info.seconds << " s ("
+       << setprecision(1) << mb / std::max(info.seconds, 1e-9) << " MB/s, "
+       << info.threads << " threads)" << '\n';
+  cout.unsetf(ios::floatfield);
+}
+
+void Shell::dedup_stats(const vector<string> &args) {
+  ops_exactly(0);
+
+  auto info = fs.dedup_stats();
+  cout << "       Dedup: " << (info.on ? "on" : "off") << '\n';
+  cout << "      Hashed: " << info.hashed << '\n';
+  cout << "  Duplicates: " << info.duplicates << '\n';
+  cout << "       Saved: " << info.saved << " bytes" << '\n';
+  cout << "Fingerprints: " << info.fingerprinted << '\n';
+}
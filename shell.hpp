@@ -0,0 +1,49 @@
+#ifndef _SHELL_H_
+#define _SHELL_H_
+
+#include <string>
+#include <vector>
+#include "toyfs.hpp"
+
+// The text commands of the REPL over a ToyFS. Each takes the command
+// line split into words, args[0] being the command's name, parses the
+// arguments, makes the matching ToyFS calls and prints the results to
+// cout and errors to cerr.
+class Shell {
+  ToyFS &fs;
+
+ public:
+  explicit Shell(ToyFS &fs) : fs(fs) {}
+
+  void open(const std::vector<std::string> &args);
+  void read(const std::vector<std::string> &args);
+  void write(const std::vector<std::string> &args);
+  void seek(const std::vector<std::string> &args);
+  void close(const std::vector<std::string> &args);
+  void mkdir(const std::vector<std::string> &args);
+  void rmdir(const std::vector<std::string> &args);
+  void cd(const std::vector<std::string> &args);
+  void link(const std::vector<std::string> &args);
+  void unlink(const std::vector<std::string> &args);
+  void stat(const std::vector<std::string> &args);
+  void ls(const std::vector<std::string> &args);
+  void cat(const std::vector<std::string> &args);
+  void cp(const std::vector<std::string> &args);
+  void tree(const std::vector<std::string> &args);
+  void import(const std::vector<std::string> &args);
+  void printwd(const std::vector<std::string> &args);
+  void FS_export(const std::vector<std::string> &args);
+  void df(const std::vector<std::string> &args);
+  void sync(const std::vector<std::string> &args);
+  void dcache_stats(const std::vector<std::string> &args);
+  // stats [on | off | reset | dump filename]
+  void stats(const std::vector<std::string> &args);
+  // compress [on | off]
+  void compress(const std::vector<std::string> &args);
+  // dedup [on | off]
+  void dedup(const std::vector<std::string> &args);
+  void dedup_stats(const std::vector<std::string> &args);
+  void scrub(const std::vector<std::string> &args);
+};
+
+#endif /* _SHELL_H_ */
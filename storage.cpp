@@ -0,0 +1,184 @@
+#include "storage.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::cerr;
+using std::endl;
+using std::min;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+unique_ptr<Storage> Storage::create(const string &filename,
+                                    const uint size,
+                                    StorageMode mode,
+                                    bool existing) {
+  if (mode == mmap_mode) {
+    unique_ptr<MmapStorage> disk(new MmapStorage(filename, size, existing));
+    if (disk->is_open()) {
+      return unique_ptr<Storage>(disk.release());
+    }
+    cerr << "warning: cannot map " << filename << ", using file I/O" << endl;
+  }
+  return unique_ptr<Storage>(new FileStorage(filename, size, existing));
+}
+
+void Storage::readv(uint addr, const vector<iovec> &bufs) {
+  for (auto &iov : bufs) {
+    read(addr, static_cast<char *>(iov.iov_base), iov.iov_len);
+    addr += iov.iov_len;
+  }
+}
+
+void Storage::writev(uint addr, const vector<iovec> &bufs) {
+  for (auto &iov : bufs) {
+    write(addr, static_cast<const char *>(iov.iov_base), iov.iov_len);
+    addr += iov.iov_len;
+  }
+}
+
+FileStorage::FileStorage(const string &filename, const uint size,
+                         bool existing) {
+  fd = ::open(filename.c_str(), O_RDWR | (existing ? 0 : O_CREAT | O_TRUNC),
+              0644);
+  // a freshly truncated file is one big hole that reads back as zeroes
+  if (fd >= 0 && !existing && ftruncate(fd, size) != 0) {
+    ::close(fd);
+    fd = -1;
+  }
+}
+
+FileStorage::~FileStorage() {
+  if (fd >= 0) {
+    ::close(fd);
+  }
+}
+
+void FileStorage::read(uint addr, char *buf, uint len) {
+  while (len > 0) {
+    ssize_t n = pread(fd, buf, len, addr);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) continue;
+      cerr << "error: disk read failed: " << strerror(errno) << endl;
+      return;
+    }
+    addr += n;
+    buf += n;
+    len -= n;
+  }
+}
+
+void FileStorage::write(uint addr, const char *buf, uint len) {
+  while (len > 0) {
+    ssize_t n = pwrite(fd, buf, len, addr);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      cerr << "error: disk write failed: " << strerror(errno) << endl;
+      return;
+    }
+    addr += n;
+    buf += n;
+    len -= n;
+  }
+}
+
+// preadv and pwritev may transfer less than asked for, and take at most
+// IOV_MAX buffers, so keep resubmitting whatever is left
+static void transfer_v(int fd, uint addr, vector<iovec> left, bool writing) {
+  auto first = begin(left);
+  while (first != end(left)) {
+    int count = min<long>(end(left) - first, IOV_MAX);
+    ssize_t n = writing ? pwritev(fd, &*first, count, addr)
+                        : preadv(fd, &*first, count, addr);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) continue;
+      cerr << "error: disk " << (writing ? "write" : "read") << " failed: "
+           << strerror(errno) << endl;
+      return;
+    }
+    addr += n;
+    for (; first != end(left) && static_cast<size_t>(n) >= first->iov_len; ++first) {
+      n -= first->iov_len;
+    }
+    if (n > 0) {
+      first->iov_base = static_cast<char *>(first->iov_base) + n;
+      first->iov_len -= n;
+    }
+  }
+}
+
+void FileStorage::readv(uint addr, const vector<iovec> &bufs) {
+  transfer_v(fd, addr, bufs, false);
+}
+
+void FileStorage::writev(uint addr, const vector<iovec> &bufs) {
+  transfer_v(fd, addr, bufs, true);
+}
+
+void FileStorage::sync() {
+  fdatasync(fd);
+}
+
+static bool punch_hole(int fd, uint addr, uint len) {
+  return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                   addr, len) == 0;
+}
+
+bool FileStorage::discard(uint addr, uint len) {
+  return punch_hole(fd, addr, len);
+}
+
+MmapStorage::MmapStorage(const string &filename, const uint size,
+                         bool existing)
+    : fd(-1), base(nullptr), size(size) {
+  fd = ::open(filename.c_str(), O_RDWR | (existing ? 0 : O_CREAT | O_TRUNC),
+              0644);
+  if (fd < 0) {
+    return;
+  }
+  // a freshly truncated file reads back as zeroes, and an existing one
+  // must cover the whole mapping
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      (static_cast<uint64_t>(st.st_size) < size && ftruncate(fd, size) != 0)) {
+    return;
+  }
+  void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (addr != MAP_FAILED) {
+    base = static_cast<char *>(addr);
+  }
+}
+
+MmapStorage::~MmapStorage() {
+  if (base != nullptr) {
+    munmap(base, size);
+  }
+  if (fd >= 0) {
+    ::close(fd);
+  }
+}
+
+void MmapStorage::read(uint addr, char *buf, uint len) {
+  memcpy(buf, base + addr, len);
+}
+
+void MmapStorage::write(uint addr, const char *buf, uint len) {
+  memcpy(base + addr, buf, len);
+}
+
+void MmapStorage::sync() {
+  msync(base, size, MS_SYNC);
+}
+
+// punching the file also drops the pages from the shared mapping
+bool MmapStorage::discard(uint addr, uint len) {
+  return punch_hole(fd, addr, len);
+}
@@ -0,0 +1,76 @@
+#ifndef _STORAGE_H_
+#define _STORAGE_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+enum StorageMode { file_mode, mmap_mode };
+
+// The disk image backing a ToyFS. Addresses are byte offsets into the
+// image.
+class Storage {
+ public:
+  // open the image of size bytes, creating it zeroed unless existing is
+  // set (new images are sparse, so this is instant), and falling back to
+  // file_mode if the requested mode cannot be set up
+  static std::unique_ptr<Storage> create(const std::string &filename,
+                                         const uint size,
+                                         StorageMode mode,
+                                         bool existing);
+  virtual ~Storage() {}
+  // false if the image couldn't be opened, or a new one sized
+  virtual bool is_open() const = 0;
+  virtual StorageMode mode() const = 0;
+  virtual void read(uint addr, char *buf, uint len) = 0;
+  virtual void write(uint addr, const char *buf, uint len) = 0;
+  // transfer the contiguous range starting at addr to or from several
+  // buffers in one request
+  virtual void readv(uint addr, const std::vector<iovec> &bufs);
+  virtual void writev(uint addr, const std::vector<iovec> &bufs);
+  // make everything written so far durable
+  virtual void sync() = 0;
+  // release the space behind a range so it reads back as zeroes;
+  // returns false if the image can't do that
+  virtual bool discard(uint, uint) { return false; }
+  // the image's open file, for I/O that bypasses Storage; -1 if none
+  virtual int file_descriptor() const { return -1; }
+};
+
+// Positional I/O on a file descriptor: every request is a single
+// pread/pwrite (or preadv/pwritev) with no shared file position
+class FileStorage : public Storage {
+  int fd;
+ public:
+  FileStorage(const std::string &filename, const uint size, bool existing);
+  ~FileStorage();
+  bool is_open() const { return fd >= 0; }
+  StorageMode mode() const { return file_mode; }
+  void read(uint addr, char *buf, uint len);
+  void write(uint addr, const char *buf, uint len);
+  void readv(uint addr, const std::vector<iovec> &bufs);
+  void writev(uint addr, const std::vector<iovec> &bufs);
+  void sync();
+  bool discard(uint addr, uint len);
+  int file_descriptor() const { return fd; }
+};
+
+// Maps the whole image into memory so block I/O is a memcpy
+class MmapStorage : public Storage {
+  int fd;
+  char *base;
+  uint size;
+ public:
+  MmapStorage(const std::string &filename, const uint size, bool existing);
+  ~MmapStorage();
+  bool is_open() const { return base != nullptr; }
+  StorageMode mode() const { return mmap_mode; }
+  void read(uint addr, char *buf, uint len);
+  void write(uint addr, const char *buf, uint len);
+  void sync();
+  bool discard(uint addr, uint len);
+};
+
+#endif /* _STORAGE_H_ */
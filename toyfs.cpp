@@ -1,81 +1,866 @@
 #include "toyfs.hpp"
+#include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <cstring>
+#include <fstream>
+#include <future>
 #include <iostream>
-#include <iomanip>
+#include <limits>
 #include <list>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 #include <deque>
+#include <unordered_map>
 #include <assert.h>
 #include "direntry.hpp"
 #include "inode.hpp"
-#include "freenode.hpp"
+#include "allocator.hpp"
+#include "fingerprint.hpp"
+#include "lz.hpp"
 
 using namespace std;
 
-#define ops_at_least(x)                                 \
-  if (static_cast<int>(args.size()) < x+1) {            \
-    cerr << args[0] << ": missing operand" << endl;     \
-    return;                                             \
-  }
-
-#define ops_less_than(x)                                \
-  if (static_cast<int>(args.size()) > x+1) {            \
-    cerr << args[0] << ": too many operands" << endl;   \
-    return;                                             \
-  }
-
-#define ops_exactly(x)                          \
-  ops_at_least(x);                              \
-  ops_less_than(x);
+// maximum number of resolved paths kept by parse_path
+const uint DCACHE_SIZE = 4096;
+// the first and largest windows read ahead of a sequential reader, in
+// blocks
+const uint RA_MIN_BLOCKS = 4;
+const uint RA_MAX_BLOCKS = 64;
+// how much of a compressed file is compressed together
+const uint CLUSTER_BYTES = 16 << 10;
+// no cluster decompressed in a descriptor
+const uint NO_CLUSTER = numeric_limits<uint>::max();
+// most blocks scrub reads with one request, and most threads it uses
+const uint SCRUB_CHUNK = 256;
+const uint SCRUB_THREADS = 8;
+// buffer size for copying files in and out of the image
+const uint STREAM_CHUNK = 1 << 20;
+// size of the journal, unless that is more than an eighth of the disk
+const uint JOURNAL_BYTES = 4 << 20;
+
+// journal record types; each is followed by absolute paths, and J_INODE
+// by the file's size, blocks used, extents, inline data and clusters
+enum JournalOp : uint8_t {
+  J_MKDIR = 1,
+  J_CREATE,
+  J_LINK,
+  J_UNLINK,
+  J_RMDIR,
+  J_INODE
+};
 
 ToyFS::ToyFS(const string& filename,
              const uint fs_size,
              const uint block_size,
-             const uint direct_blocks)
-    : filename(filename),
-      block_size(block_size),
-      direct_blocks(direct_blocks),
-      num_blocks(ceil(static_cast<double>(fs_size) / block_size)) {
+             const uint direct_blocks,
+             const uint cache_blocks,
+             const StorageMode mode,
+             const bool format,
+             const bool async_io,
+             const uint max_open,
+             const uint inline_max)
+    : super(image_geometry(filename, fs_size, block_size, direct_blocks, format)),
+      filename(filename),
+      block_size(super.block_size),
+      direct_blocks(super.direct_blocks),
+      num_blocks(super.num_blocks),
+      disk(Storage::create(filename, num_blocks * block_size, mode,
+                           super.magic == TOYFS_MAGIC)),
+      engine(async_io ? IOEngine::create(*disk) : nullptr),
+      // the page cache already buffers a mapped image
+      cache(*disk, block_size, disk->mode() == mmap_mode ? 0 : cache_blocks,
+            engine.get()),
+      journal(cache, block_size),
+      allocator(num_blocks),
+      max_open(max_open),
+      open_files(new Descriptor[max_open]),
+      dcache(DCACHE_SIZE) {
 
   Inode::block_size = block_size;
-  Inode::free_list = &free_list;
+  // inline data has to fit in the block it moves to
+  Inode::inline_max = min(inline_max, this->block_size);
+  Inode::cluster_blocks = max(1u, CLUSTER_BYTES / this->block_size);
+  Inode::allocator = &allocator;
+  allocator.on_free = [this] (uint start, uint count) {
+    discard_blocks(start, count);
+  };
+  // freed blocks keep their data until the change freeing them is
+  // durable, in case a crash brings the old owner back
+  allocator.hold = [this] () {
+    return journal.position();
+  };
   root_dir = DirEntry::make_de_dir("root", nullptr);
   // start at root dir;
   pwd = root_dir;
-  init_disk(filename);
-  free_list.emplace_back(num_blocks, 0);
+
+  // an image that can't be mounted is left alone rather than reformatted
+  if (!disk->is_open()) {
+    status = FS_HOST_IO;
+  } else if (super.magic != TOYFS_MAGIC) {
+    format_disk();
+  } else if (!super.usable()) {
+    status = FS_BAD_VERSION;
+  } else if (!mount()) {
+    status = FS_BAD_IMAGE;
+  }
 }
 
 ToyFS::~ToyFS() {
-  disk_file.close();
-  remove(filename.c_str());
+  if (status == FS_OK) {
+    checkpoint();
+    cache.sync();
+  }
+  // the inodes dropped with the tree still own their blocks on disk
+  allocator.on_free = nullptr;
+  allocator.hold = nullptr;
+  engine.reset();
+  disk.reset();
 }
 
-void ToyFS::init_disk(const string& filename) {
-  const vector<char>zeroes(num_blocks, 0);
+// called whenever blocks are freed: give the space back to the host
+// file system and forget any cached copies
+void ToyFS::discard_blocks(uint start, uint count) {
+  cache.discard(start, count);
+  if (!zero_on_alloc && !disk->discard(start * block_size, count * block_size)) {
+    // freed blocks keep their old contents, so clear new ones instead
+    zero_on_alloc = true;
+  }
+}
 
-  disk_file.open(filename,
-                 fstream::in |
-                 fstream::out |
-                 fstream::binary |
-                 fstream::trunc);
+Superblock ToyFS::image_geometry(const string &filename,
+                                 const uint fs_size,
+                                 const uint block_size,
+                                 const uint direct_blocks,
+                                 const bool format) {
+  Superblock super;
+  bool found = !format && Superblock::probe(filename, &super);
+  if (found && super.usable()) {
+    return super;
+  }
+  // an image this version can't mount keeps its magic and version, so
+  // the constructor refuses it, but none of its geometry is trusted
+  uint32_t version = super.version;
+  super = Superblock();
+  if (found) {
+    super.magic = TOYFS_MAGIC;
+    super.version = version;
+  }
+  super.block_size = block_size;
+  super.num_blocks = ceil(static_cast<double>(fs_size) / block_size);
+  super.direct_blocks = direct_blocks;
+  return super;
+}
 
-  for (uint i = 0; i < num_blocks; ++i) {
-    disk_file.write(zeroes.data(), block_size);
+void ToyFS::write_superblock() {
+  vector<char> block(block_size, 0);
+  super.meta_run_count = meta_runs.size();
+  memcpy(block.data(), &super, sizeof(super));
+  char *run_p = block.data() + sizeof(super);
+  for (auto &run : meta_runs) {
+    uint32_t pair[2] = {run.first, run.second};
+    memcpy(run_p, pair, sizeof(pair));
+    run_p += sizeof(pair);
   }
+  cache.write(0, block.data(), block_size);
 }
 
-unique_ptr<ToyFS::PathRet> ToyFS::parse_path(string path_str) const {
-  unique_ptr<PathRet> ret(new PathRet);
+void ToyFS::format_disk() {
+  for (auto &run : meta_runs) {
+    allocator.free(run.first, run.second);
+  }
+  meta_runs.clear();
+  super.magic = TOYFS_MAGIC;
+  super.version = TOYFS_VERSION;
+  super.meta_bytes = 0;
+  // block 0 holds the superblock, and the journal follows it
+  allocator.reserve(0, 1);
+  uint journal_blocks = min(JOURNAL_BYTES / block_size, num_blocks / 8);
+  uint journal_start;
+  if (!allocator.allocate_run(journal_blocks, &journal_start)) {
+    journal_start = journal_blocks = 0;
+  }
+  journal.attach(journal_start, journal_blocks, 0);
+  // an initial checkpoint records where the journal is
+  checkpoint();
+}
+
+// Metadata layout, in order:
+//   free-space map: u32 count, then (start, length) runs of free blocks
+//   shared blocks:  u32 count, then (start, length, owners) runs of
+//                   blocks with more than one owner (version 2 on)
+//   journal:        u32 start, u32 blocks and u32 epoch of the log of
+//                   changes made since this checkpoint (version 3 on)
+//   inode table:    u32 count, then per inode u32 size, u32 blocks_used,
+//                   u32 extent count and (file block, start, length)s,
+//                   then its inline data (version 4 on), then u8
+//                   compressed, u32 cluster count and (start, blocks,
+//                   bytes)s (version 5 on), then its checksums as
+//                   below (version 6 on)
+//   directory tree: per directory u32 child count, then per child
+//                   u8 type and name, then an u32 inode number for
+//                   files or the child's own listing for directories
+static void write_clusters(const Inode &inode, MetaWriter *out) {
+  out->u8(inode.compressed);
+  out->u32(inode.clusters.size());
+  for (auto &cluster : inode.clusters) {
+    out->u32(cluster.start);
+    out->u32(cluster.blocks);
+    out->u32(cluster.bytes);
+  }
+}
+
+static bool read_clusters(MetaReader *in, uint num_blocks, bool *compressed,
+                          vector<Inode::Cluster> *clusters) {
+  uint8_t flag;
+  uint32_t count;
+  if (!in->u8(&flag) || !in->u32(&count)) {
+    return false;
+  }
+  *compressed = flag != 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t start, blocks, bytes;
+    if (!in->u32(&start) || !in->u32(&blocks) || !in->u32(&bytes) ||
+        blocks > Inode::cluster_blocks || start > num_blocks - blocks ||
+        bytes > blocks * Inode::block_size) {
+      return false;
+    }
+    clusters->push_back(Inode::Cluster{start, blocks, bytes});
+  }
+  return true;
+}
+
+// checksums: u32 count, u32 range count, then per range u32 first, u32
+// length and that many checksums. A record holds only the ranges that
+// changed; count is the length of the whole table.
+static void write_checksums(const Inode &inode,
+                            const vector<pair<uint, uint>> &ranges,
+                            MetaWriter *out) {
+  out->u32(inode.checksums.size());
+  out->u32(ranges.size());
+  for (auto &range : ranges) {
+    out->u32(range.first);
+    out->u32(range.second);
+    for (uint i = range.first; i < range.first + range.second; ++i) {
+      out->u32(inode.checksums[i]);
+    }
+  }
+}
+
+// apply the ranges read to checksums
+static bool read_checksums(MetaReader *in, uint num_blocks,
+                           vector<uint32_t> *checksums) {
+  uint32_t count, ranges;
+  if (!in->u32(&count) || !in->u32(&ranges) || count > num_blocks) {
+    return false;
+  }
+  checksums->resize(count);
+  for (uint32_t r = 0; r < ranges; ++r) {
+    uint32_t first, length;
+    if (!in->u32(&first) || !in->u32(&length) || first > count ||
+        length > count - first) {
+      return false;
+    }
+    for (uint32_t i = first; i < first + length; ++i) {
+      if (!in->u32(&(*checksums)[i])) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static void collect_inodes(const shared_ptr<DirEntry> &directory,
+                           unordered_map<const Inode *, uint> *numbers,
+                           vector<const Inode *> *table) {
+  for (auto &child : directory->entries()) {
+    if (child->type == dir) {
+      collect_inodes(child, numbers, table);
+    } else if (numbers->emplace(child->inode.get(), table->size()).second) {
+      table->push_back(child->inode.get());
+    }
+  }
+}
+
+static void write_tree(const shared_ptr<DirEntry> &directory,
+                       const unordered_map<const Inode *, uint> &numbers,
+                       MetaWriter *out) {
+  auto children = directory->entries();
+  out->u32(children.size());
+  for (auto &child : children) {
+    out->u8(child->type);
+    out->str(child->name);
+    if (child->type == dir) {
+      write_tree(child, numbers, out);
+    } else {
+      out->u32(numbers.at(child->inode.get()));
+    }
+  }
+}
+
+static bool read_tree(const shared_ptr<DirEntry> &directory,
+                      const vector<shared_ptr<Inode>> &table,
+                      MetaReader *in) {
+  uint32_t count;
+  if (!in->u32(&count)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < count; ++i) {
+    uint8_t type;
+    string name;
+    if (!in->u8(&type) || !in->str(&name) || directory->find_child(name) != nullptr) {
+      return false;
+    }
+    if (type == dir) {
+      if (!read_tree(directory->add_dir(name), table, in)) {
+        return false;
+      }
+    } else {
+      uint32_t number;
+      if (type != file || !in->u32(&number) || number >= table.size()) {
+        return false;
+      }
+      directory->add_entry(DirEntry::make_de_file(name, directory, table[number]));
+    }
+  }
+  return true;
+}
 
+// write the directory tree, inodes and free-space map to fresh blocks
+// and point the superblock at them
+bool ToyFS::checkpoint() {
+  // nothing may change the tree, inodes or allocator while we save them
+  lock_guard<SharedMutex> guard(ops_lock);
+  // what the descriptors have written so far is in this checkpoint
+  ++checkpoints;
+  unordered_map<const Inode *, uint> numbers;
+  vector<const Inode *> table;
+  collect_inodes(root_dir, &numbers, &table);
+
+  MetaWriter body;
+  body.u32(table.size());
+  for (auto inode : table) {
+    body.u32(inode->size);
+    body.u32(inode->blocks_used);
+    body.u32(inode->extents.size());
+    for (auto &ext : inode->extents) {
+      body.u32(ext.file_block);
+      body.u32(ext.start);
+      body.u32(ext.length);
+    }
+    body.str(inode->inline_data);
+    write_clusters(*inode, &body);
+    write_checksums(*inode, {{0, inode->checksums.size()}}, &body);
+  }
+  write_tree(root_dir, numbers, &body);
+
+  // taking the new runs can split at most one free run, and releasing
+  // the old ones adds at most one free run each. Held runs are free as
+  // far as this checkpoint is concerned.
+  uint max_free_runs = allocator.free_extents() + allocator.held_extents() +
+      1 + meta_runs.size();
+  uint max_bytes = body.buf.size() + 4 + 8 * max_free_runs +
+      4 + 12 * allocator.shared_blocks() + 12;
+  vector<pair<uint, uint>> new_runs;
+  uint new_blocks = (max_bytes + block_size - 1) / block_size;
+  if (!allocator.allocate(new_blocks, &new_runs) ||
+      new_runs.size() > Superblock::max_meta_runs(block_size)) {
+    for (auto &run : new_runs) {
+      allocator.free(run.first, run.second);
+    }
+    cerr << "error: " << filename << ": no room to save metadata" << endl;
+    return false;
+  }
+  // the old metadata stays allocated until the new superblock is on
+  // disk, but is recorded as free in the map we are about to write
+  vector<pair<uint, uint>> old_runs(new_runs);
+  old_runs.swap(meta_runs);
+  vector<pair<uint, uint>> free_map;
+  allocator.free_runs(&free_map, true);
+  free_map.insert(end(free_map), begin(old_runs), end(old_runs));
+  sort(begin(free_map), end(free_map));
+  vector<pair<uint, uint>> merged;
+  for (auto &run : free_map) {
+    if (!merged.empty() &&
+        merged.back().first + merged.back().second == run.first) {
+      merged.back().second += run.second;
+    } else {
+      merged.push_back(run);
+    }
+  }
+  free_map.swap(merged);
+
+  MetaWriter meta;
+  meta.u32(free_map.size());
+  for (auto &run : free_map) {
+    meta.u32(run.first);
+    meta.u32(run.second);
+  }
+  vector<pair<pair<uint, uint>, uint>> shared_map;
+  allocator.shared_runs(&shared_map);
+  meta.u32(shared_map.size());
+  for (auto &run : shared_map) {
+    meta.u32(run.first.first);
+    meta.u32(run.first.second);
+    meta.u32(run.second);
+  }
+  // records from before this checkpoint must not be replayed on top of it
+  uint32_t epoch = journal.current_epoch() + 1;
+  meta.u32(journal.first_block());
+  meta.u32(journal.num_blocks());
+  meta.u32(epoch);
+  meta.buf += body.buf;
+
+  // the metadata must be on disk before the superblock points at it
+  const char *meta_p = meta.buf.data();
+  uint left = meta.buf.size();
+  for (auto &run : meta_runs) {
+    uint len = min(left, run.second * block_size);
+    cache.write(run.first * block_size, meta_p, len);
+    meta_p += len;
+    left -= len;
+  }
+  cache.sync();
+  super.version = TOYFS_VERSION;
+  super.meta_bytes = meta.buf.size();
+  write_superblock();
+  cache.sync();
+  for (auto &run : old_runs) {
+    allocator.free(run.first, run.second);
+  }
+  // nothing points at the held blocks any more, journal or no journal
+  allocator.release_all();
+  journal.reset(epoch);
+  return true;
+}
+
+bool ToyFS::mount() {
+  vector<char> block(block_size);
+  cache.read(0, block.data(), block_size);
+  if (super.meta_run_count > Superblock::max_meta_runs(block_size)) {
+    return false;
+  }
+  const char *run_p = block.data() + sizeof(super);
+  for (uint i = 0; i < super.meta_run_count; ++i) {
+    uint32_t pair[2];
+    memcpy(pair, run_p, sizeof(pair));
+    run_p += sizeof(pair);
+    if (pair[0] >= num_blocks || pair[1] > num_blocks - pair[0]) {
+      return false;
+    }
+    meta_runs.push_back(make_pair(pair[0], pair[1]));
+  }
+
+  string meta(super.meta_bytes, '\0');
+  uint done = 0;
+  for (auto &run : meta_runs) {
+    uint len = min(super.meta_bytes - done, run.second * block_size);
+    cache.read(run.first * block_size, &meta[done], len);
+    done += len;
+  }
+  if (done != super.meta_bytes) {
+    meta_runs.clear();
+    return false;
+  }
+  MetaReader in(meta);
+
+  // everything outside the free runs is in use
+  uint32_t count;
+  uint next = 0;
+  bool ok = in.u32(&count);
+  for (uint32_t i = 0; ok && i < count; ++i) {
+    uint32_t start, length;
+    ok = in.u32(&start) && in.u32(&length) && start >= next &&
+        start < num_blocks && length > 0 && length <= num_blocks - start;
+    if (ok) {
+      allocator.reserve(next, start - next);
+      next = start + length;
+    }
+  }
+  if (ok) {
+    allocator.reserve(next, num_blocks - next);
+  }
+
+  if (ok && super.version >= 2) {
+    ok = in.u32(&count);
+    for (uint32_t i = 0; ok && i < count; ++i) {
+      uint32_t start, length, owners;
+      ok = in.u32(&start) && in.u32(&length) && in.u32(&owners) &&
+          start < num_blocks && length <= num_blocks - start && owners > 1;
+      for (uint b = start; ok && b < start + length; ++b) {
+        ok = !allocator.is_free(b);
+      }
+      for (uint32_t j = 1; ok && j < owners; ++j) {
+        allocator.share(start, length);
+      }
+    }
+  }
+
+  uint32_t journal_start = 0, journal_blocks = 0, epoch = 0;
+  if (ok && super.version >= 3) {
+    ok = in.u32(&journal_start) && in.u32(&journal_blocks) && in.u32(&epoch) &&
+        journal_start <= num_blocks && journal_blocks <= num_blocks - journal_start;
+    for (uint b = journal_start; ok && b < journal_start + journal_blocks; ++b) {
+      ok = !allocator.is_free(b);
+    }
+  }
+
+  vector<shared_ptr<Inode>> table;
+  ok = ok && in.u32(&count);
+  for (uint32_t i = 0; ok && i < count; ++i) {
+    auto inode = make_shared<Inode>();
+    uint32_t size, blocks_used, extent_count;
+    ok = in.u32(&size) && in.u32(&blocks_used) && in.u32(&extent_count);
+    for (uint32_t j = 0; ok && j < extent_count; ++j) {
+      uint32_t file_block, start, length;
+      ok = in.u32(&file_block) && in.u32(&start) && in.u32(&length) &&
+          start < num_blocks && length <= num_blocks - start;
+      if (ok) {
+        inode->extents.push_back(Inode::Extent{file_block, start, length});
+      }
+    }
+    if (ok && super.version >= 4) {
+      ok = in.str(&inode->inline_data) &&
+          (inode->inline_data.empty() || blocks_used == 0);
+    }
+    if (ok && super.version >= 5) {
+      ok = read_clusters(&in, num_blocks, &inode->compressed, &inode->clusters);
+    }
+    if (ok && super.version >= 6) {
+      ok = read_checksums(&in, num_blocks, &inode->checksums);
+    }
+    inode->size = size;
+    inode->blocks_used = blocks_used;
+    table.push_back(inode);
+  }
+  ok = ok && read_tree(root_dir, table, &in);
+
+  if (!ok) {
+    // drop whatever was loaded without handing its blocks back
+    for (auto &inode : table) {
+      inode->extents.clear();
+      inode->clusters.clear();
+    }
+    table.clear();
+    root_dir = DirEntry::make_de_dir("root", nullptr);
+    pwd = root_dir;
+    meta_runs.clear();
+    allocator.reset();
+    return false;
+  }
+  table.clear();
+
+  if (super.version < 3) {
+    // older images have no journal; make one if there is room
+    journal_blocks = min(JOURNAL_BYTES / block_size, num_blocks / 8);
+    if (!allocator.allocate_run(journal_blocks, &journal_start)) {
+      journal_start = journal_blocks = 0;
+    }
+    journal.attach(journal_start, journal_blocks, 0);
+    compute_checksums();
+    checkpoint();
+    return true;
+  }
+
+  // redo whatever was committed after the checkpoint. Block accounting
+  // is off meanwhile, since the allocator only knows the checkpoint's
+  // state, and is rebuilt from the extents afterwards.
+  journal.attach(journal_start, journal_blocks, epoch);
+  auto records = journal.replay();
+  if (!records.empty()) {
+    Inode::allocator = nullptr;
+    uint applied = 0;
+    while (applied < records.size() && replay(records[applied])) {
+      ++applied;
+    }
+    if (applied < records.size()) {
+      cerr << "error: " << filename << ": could not replay journal record "
+           << applied + 1 << " of " << records.size() << endl;
+    }
+    dcache_invalidate();
+    Inode::allocator = &allocator;
+    rebuild_allocator();
+  }
+  if (super.version < 6) {
+    compute_checksums();
+  }
+  if (!records.empty() || super.version < 6) {
+    checkpoint();
+  }
+  return true;
+}
+
+// images from before version 6 have no checksums, so sum everything
+// they hold as it is now
+void ToyFS::compute_checksums() {
+  unordered_map<const Inode *, uint> numbers;
+  vector<const Inode *> table;
+  collect_inodes(root_dir, &numbers, &table);
+  vector<char> data(Inode::cluster_blocks * block_size);
+  for (auto inode_p : table) {
+    Inode &inode = const_cast<Inode &>(*inode_p);
+    if (inode.compressed) {
+      inode.checksums.assign(inode.clusters.size(), 0);
+      for (uint i = 0; i < inode.clusters.size(); ++i) {
+        auto &cluster = inode.clusters[i];
+        cache.read(cluster.start * block_size, data.data(),
+                   cluster.blocks * block_size);
+        inode.checksums[i] = crc32c(data.data(), cluster.blocks * block_size);
+      }
+      continue;
+    }
+    inode.checksums.assign((inode.size + block_size - 1) / block_size, 0);
+    for (auto &ext : inode.extents) {
+      for (uint k = 0; k < ext.length; ++k) {
+        cache.read((ext.start + k) * block_size, data.data(), block_size);
+        if (ext.file_block + k < inode.checksums.size()) {
+          inode.checksums[ext.file_block + k] = crc32c(data.data(), block_size);
+        }
+      }
+    }
+  }
+}
+
+// apply one journal record to the tree; false if it doesn't fit
+bool ToyFS::replay(const string &record) {
+  MetaReader in(record);
+  uint8_t op;
+  string path_str;
+  if (!in.u8(&op) || !in.str(&path_str) || path_str.empty() ||
+      path_str[0] != '/') {
+    return false;
+  }
+  dcache_invalidate();
+  auto path = parse_path(path_str);
+  auto node = path->final_node;
+  auto parent = path->parent_node;
+  if (path->invalid_path) {
+    return false;
+  }
+
+  switch (op) {
+    case J_MKDIR:
+      return node == nullptr && parent->add_dir(path->final_name) != nullptr;
+    case J_CREATE:
+      return node == nullptr && parent->add_file(path->final_name) != nullptr;
+    case J_LINK: {
+      string dest_str;
+      if (node == nullptr || node->type != file || !in.str(&dest_str)) {
+        return false;
+      }
+      auto dest = parse_path(dest_str);
+      return !dest->invalid_path && dest->final_node == nullptr &&
+          dest->parent_node->add_entry(DirEntry::make_de_file(
+              dest->final_name, dest->parent_node, node->inode));
+    }
+    case J_UNLINK:
+      return node != nullptr && node->type == file &&
+          parent->remove_child(node->name);
+    case J_RMDIR:
+      return node != nullptr && node->type == dir && node != root_dir &&
+          node->remove_if_empty() && parent->remove_child(node->name);
+    case J_INODE: {
+      uint32_t size, blocks_used, count;
+      if (node == nullptr || node->type != file || !in.u32(&size) ||
+          !in.u32(&blocks_used) || !in.u32(&count)) {
+        return false;
+      }
+      vector<Inode::Extent> extents;
+      for (uint32_t i = 0; i < count; ++i) {
+        uint32_t file_block, start, length;
+        if (!in.u32(&file_block) || !in.u32(&start) || !in.u32(&length) ||
+            start >= num_blocks || length > num_blocks - start) {
+          return false;
+        }
+        extents.push_back(Inode::Extent{file_block, start, length});
+      }
+      // records from before version 4 have no inline data, from before
+      // version 5 no clusters and from before version 6 no checksums
+      string inline_data;
+      bool compressed = false;
+      vector<Inode::Cluster> clusters;
+      vector<uint32_t> checksums = node->inode->checksums;
+      if (in.str(&inline_data)) {
+        if (!read_clusters(&in, num_blocks, &compressed, &clusters)) {
+          clusters.clear();
+        } else if (!read_checksums(&in, num_blocks, &checksums)) {
+          checksums = node->inode->checksums;
+        }
+      }
+      node->inode->extents.swap(extents);
+      node->inode->inline_data.swap(inline_data);
+      node->inode->compressed = compressed;
+      node->inode->clusters.swap(clusters);
+      node->inode->checksums.swap(checksums);
+      node->inode->size = size;
+      node->inode->blocks_used = blocks_used;
+      return true;
+    }
+  }
+  return false;
+}
+
+// mark everything the metadata, journal and files use, counting the
+// owners of blocks files share
+void ToyFS::rebuild_allocator() {
+  allocator.reset();
+  allocator.reserve(0, 1);
+  for (auto &run : meta_runs) {
+    allocator.reserve(run.first, run.second);
+  }
+  allocator.reserve(journal.first_block(), journal.num_blocks());
+
+  unordered_map<const Inode *, uint> numbers;
+  vector<const Inode *> table;
+  collect_inodes(root_dir, &numbers, &table);
+  auto mark = [this] (uint start, uint count) {
+    for (uint b = start; b < start + count; ++b) {
+      if (allocator.is_free(b)) {
+        allocator.reserve(b, 1);
+      } else {
+        allocator.share(b, 1);
+      }
+    }
+  };
+  for (auto inode : table) {
+    for (auto &ext : inode->extents) {
+      mark(ext.start, ext.length);
+    }
+    for (auto &cluster : inode->clusters) {
+      mark(cluster.start, cluster.blocks);
+    }
+  }
+}
+
+// absolute path of an entry
+static string path_of(shared_ptr<DirEntry> entry) {
+  deque<string> names;
+  for (auto up = entry->parent.lock(); up != entry; up = entry->parent.lock()) {
+    names.push_front(entry->name);
+    entry = up;
+  }
+  if (names.empty()) {
+    return "/";
+  }
+  string path;
+  for (auto &name : names) {
+    path += "/" + name;
+  }
+  return path;
+}
+
+static string path_record(JournalOp op, const shared_ptr<DirEntry> &entry) {
+  MetaWriter record;
+  record.u8(op);
+  record.str(path_of(entry));
+  return record.buf;
+}
+
+// log an inode's current size, mapping, inline data and the ranges of
+// checksums that changed; called with its lock held
+void ToyFS::log_inode(const shared_ptr<DirEntry> &entry, const Inode &inode,
+                      const vector<pair<uint, uint>> &changed) {
+  MetaWriter record;
+  record.u8(J_INODE);
+  record.str(path_of(entry));
+  record.u32(inode.size);
+  record.u32(inode.blocks_used);
+  record.u32(inode.extents.size());
+  for (auto &ext : inode.extents) {
+    record.u32(ext.file_block);
+    record.u32(ext.start);
+    record.u32(ext.length);
+  }
+  record.str(inode.inline_data);
+  write_clusters(inode, &record);
+  write_checksums(inode, changed, &record);
+  journal.append(record.buf);
+}
+
+ToyFS::Update::Update(ToyFS &fs, bool commit) : fs(fs), commit(commit) {
+  fs.ops_lock.lock_shared();
+}
+
+ToyFS::Update::~Update() {
+  fs.ops_lock.unlock_shared();
+  if (commit) {
+    fs.commit();
+  }
+  if (fs.journal.full()) {
+    fs.checkpoint();
+  }
+}
+
+// make everything logged so far durable, then let the blocks it freed
+// be reused
+void ToyFS::commit() {
+  journal.commit();
+  allocator.release(journal.logged());
+}
+
+// when an allocation fails, commit so the blocks waiting on the journal
+// can be had; false if there are none
+bool ToyFS::reclaim() {
+  if (allocator.held_blocks() == 0) {
+    return false;
+  }
+  commit();
+  return true;
+}
+
+size_t ToyFS::DcacheKeyHash::operator()(const DcacheKey &key) const {
+  return hash<const DirEntry *>()(key.first) * 31 + hash<string>()(key.second);
+}
+
+void ToyFS::dcache_invalidate() {
+  // any change to the tree may turn a cached miss into a hit or vice
+  // versa, so drop everything rather than tracking dependencies
+  lock_guard<mutex> guard(dcache_lock);
+  dcache.clear();
+  ++dcache_generation;
+}
+
+shared_ptr<DirEntry> ToyFS::working_dir() const {
+  lock_guard<mutex> guard(pwd_lock);
+  return pwd;
+}
+
+ToyFS::Descriptor *ToyFS::find_descriptor(uint fd) {
+  if (fd >= max_open || !open_files[fd].in_use.load(memory_order_acquire)) {
+    return nullptr;
+  }
+  return &open_files[fd];
+}
+
+// size of a file, read under its lock
+static uint file_size(const shared_ptr<Inode> &inode) {
+  lock_guard<mutex> guard(inode->lock);
+  return inode->size;
+}
+
+unique_ptr<ToyFS::PathRet> ToyFS::parse_path(string path_str) const {
   // check if path is relative or absolute
-  ret->final_node = pwd;
+  auto start = path_str[0] == '/' ? root_dir : working_dir();
+
+  DcacheKey key(start.get(), path_str);
+  uint generation;
+  {
+    lock_guard<mutex> guard(dcache_lock);
+    const PathRet *cached = dcache.get(key);
+    if (cached != nullptr) {
+      return unique_ptr<PathRet>(new PathRet(*cached));
+    }
+    generation = dcache_generation;
+  }
+
+  unique_ptr<PathRet> ret(new PathRet);
+  ret->final_node = start;
   if (path_str[0] =='/') {
     path_str.erase(0,1);
-    ret->final_node = root_dir;
   }
   // initialize data structure
   ret->final_name = ret->final_node->name;
@@ -94,536 +879,1265 @@ unique_ptr<ToyFS::PathRet> ToyFS::parse_path(string path_str) const {
     if (ret->final_node == nullptr) {
       // something other than the last entry was not found
       ret->invalid_path = true;
-      return ret;
+      break;
     }
     ret->parent_node = ret->final_node;
     ret->final_node = ret->final_node->find_child(node_name);
     ret->final_name = node_name;
   }
 
-  return ret;
-}
-
-bool ToyFS::getMode(Mode *mode, string mode_s) {
-  if (mode_s == "w") {
-    *mode = W;
-  } else if(mode_s == "r") {
-    *mode = R;
-  } else if (mode_s == "rw") {
-    *mode = RW;
-  } else {
-    return false;
+  lock_guard<mutex> guard(dcache_lock);
+  if (generation == dcache_generation) {
+    dcache.put(key, *ret);
   }
-  return true;
+  return ret;
 }
 
-bool ToyFS::basic_open(Descriptor *d, vector <string> args) {
-  assert(args.size() == 3);
+FsError ToyFS::basic_open(Descriptor **d, const string &path, Mode mode) {
+  auto parsed = parse_path(path);
+  auto node = parsed->final_node;
+  auto parent = parsed->parent_node;
 
-  Mode mode;
-  auto path = parse_path(args[1]);
-  auto node = path->final_node;
-  auto parent = path->parent_node;
-  bool known_mode = getMode(&mode, args[2]);
-
-  if (path->invalid_path == true) {
-    cerr << args[0] << ": error: Invalid path: " << args[1] << endl;
-  } else if(!known_mode) {
-    cerr << args[0] << ": error: Unknown mode: " << args[2] << endl;
-  } else if (node == nullptr && (mode == R || mode == RW)) {
-    cerr << args[0] << ": error: " << args[1] << " does not exist." << endl;
+  if (parsed->invalid_path) {
+    return FS_INVALID_PATH;
+  } else if (node == nullptr && mode != W) {
+    return FS_NOT_FOUND;
   } else if (node != nullptr && node->type == dir) {
-    cerr << args[0] << ": error: Cannot open a directory." << endl;
-  } else if (node != nullptr && node->is_locked) {
-    cerr << args[0] << ": error: " << args[1] << " is already open." << endl;
-  } else {
-    //create the file if necessary
-    if(node == nullptr) {
-      node = parent->add_file(path->final_name);
+    return FS_NOT_FILE;
+  }
+
+  //create the file if necessary
+  if (node == nullptr) {
+    lock_guard<mutex> guard(namespace_lock);
+    node = parent->add_file(parsed->final_name);
+    if (node == nullptr) {
+      // someone else created it first, or removed the directory
+      node = parent->find_child(parsed->final_name);
+    } else {
+      journal.append(path_record(J_CREATE, node));
+      lock_guard<mutex> guard(node->inode->lock);
+      node->inode->compressed = compress_new;
     }
+    dcache_invalidate();
+  }
 
-    // get a descriptor
-    uint fd = next_descriptor++;
-    node->is_locked = true;
-    *d = Descriptor{mode, 0, node->inode, node, fd};
-    open_files[fd] = *d;
-    return true;
+  if (node == nullptr || node->type != file) {
+    return FS_INVALID_PATH;
+  } else if (node->is_locked.exchange(true)) {
+    return FS_BUSY;
   }
-  return false;
+  // get a descriptor
+  lock_guard<mutex> guard(fd_lock);
+  if (lowest_free == max_open) {
+    node->is_locked = false;
+    return FS_TOO_MANY_OPEN;
+  }
+  Descriptor &desc = open_files[lowest_free];
+  desc.mode = mode;
+  desc.byte_pos = 0;
+  desc.inode = node->inode;
+  desc.from = node;
+  desc.fd = lowest_free;
+  desc.next_read = 0;
+  desc.ra_start = 0;
+  desc.ra_size = 0;
+  desc.cluster_index = NO_CLUSTER;
+  desc.fresh_blocks.clear();
+  desc.in_use.store(true, memory_order_release);
+  while (lowest_free < max_open && open_files[lowest_free].in_use) {
+    ++lowest_free;
+  }
+  *d = &desc;
+  return FS_OK;
 }
 
-void ToyFS::open(vector<string> args) {
-  ops_exactly(2);
-  Descriptor desc;
-  if (basic_open(&desc, args)) {
-    cout << "SUCCESS: fd=" << desc.fd << endl;
+Result<uint> ToyFS::open(const string &path, Mode mode) {
+  Metrics::Scope measure(metrics, Metrics::OPEN);
+  Update update(*this);
+  Descriptor *desc;
+  FsError error = basic_open(&desc, path, mode);
+  if (error != FS_OK) {
+    return error;
   }
+  return desc->fd;
 }
 
-void ToyFS::read(vector<string> args) {
-  ops_exactly(2);
+Result<uint> ToyFS::read(uint fd, char *buf, uint size) {
+  Metrics::Scope measure(metrics, Metrics::READ);
+  return checked_read(fd, buf, size, nullptr);
+}
 
-  uint fd;
-  if ( !(istringstream(args[1]) >> fd)) {
-    cerr << "read: error: Unknown descriptor." << endl;
-    return;
-  }
-  auto desc_it = open_files.find(fd);
-  if (desc_it == open_files.end()) {
-    cerr << "read: error: File descriptor not open." << endl;
-    return;
-  }
-  auto &desc = desc_it->second;
-  if(desc.mode != R && desc.mode != RW) {
-    cerr << "read: error: " << args[1] << " not open for read." << endl;
-    return;
+Result<uint> ToyFS::checked_read(uint fd, char *buf, uint size,
+                                 const shared_ptr<Pending> &pending) {
+  auto desc = find_descriptor(fd);
+  if (desc == nullptr) {
+    return FS_BAD_FD;
+  } else if (desc->mode != R && desc->mode != RW) {
+    return FS_BAD_MODE;
   }
-
-  uint size;
-  if (!(istringstream(args[2]) >> size)) {
-    cerr << "read: error: Invalid read size." << endl;
-  } else if (size + desc.byte_pos > desc.inode.lock()->size) {
-    cerr << "read: error: Read goes beyond file end." << endl;
-  } else {
-    auto data = basic_read(desc, size);
-    cout << *data << endl;
+  // the position can be anywhere since seek allows going past the end
+  uint end = file_size(desc->inode);
+  if (desc->byte_pos > end || size > end - desc->byte_pos) {
+    return FS_PAST_END;
   }
+  return basic_read(*desc, buf, size, pending);
 }
 
-unique_ptr<string> ToyFS::basic_read(Descriptor &desc, const uint size) {
-  char *data = new char[size];
+// read size bytes at the descriptor's position into data. Given an
+// async call, the runs streamed from disk are left to the engine, and
+// the blocks they fill are checked once they are in.
+Result<uint> ToyFS::basic_read(Descriptor &desc, char *data, const uint size,
+                               const shared_ptr<Pending> &pending) {
   char *data_p = data;
   uint &pos = desc.byte_pos;
   uint bytes_to_read = size;
-  auto inode = desc.inode.lock();
+  auto &inode = desc.inode;
+  lock_guard<mutex> guard(inode->lock);
+
+  if (inode->blocks_used == 0) {
+    memcpy(data, inode->inline_data.data() + pos, size);
+    pos += size;
+    Metrics::count(Metrics::BYTES_READ, size);
+    return size;
+  } else if (inode->compressed) {
+    return compressed_read(desc, data, size);
+  }
 
-  uint dbytes = direct_blocks * block_size;
+  // one segment per extent, handed to the cache together
+  vector<BlockCache::Segment> segments;
   while (bytes_to_read > 0) {
-    uint read_size = min(bytes_to_read, block_size - pos % block_size);
-    uint read_src;
-    if (pos < dbytes) {
-      read_src = inode->d_blocks[pos / block_size] + pos % block_size;
+    uint disk_block, run;
+    bool mapped = inode->map_block(pos / block_size, &disk_block, &run);
+    uint offset = pos % block_size;
+    uint read_size = min<uint64_t>(bytes_to_read,
+                                   static_cast<uint64_t>(run) * block_size - offset);
+    if (mapped) {
+      segments.push_back(BlockCache::Segment{disk_block * block_size + offset,
+                                             data_p, read_size});
     } else {
-      uint i = (pos - dbytes) / (direct_blocks * block_size);
-      uint j = (pos - dbytes) / block_size % direct_blocks;
-      read_src = inode->i_blocks->at(i)[j] + pos % block_size;
+      // a hole reads as zeroes
+      memset(data_p, 0, read_size);
     }
-    disk_file.seekp(read_src);
-    disk_file.read(data_p, read_size);
     pos += read_size;
     data_p += read_size;
     bytes_to_read -= read_size;
   }
-  return unique_ptr<string>(new string(data, size));
+  uint bad_block;
+  if (pending == nullptr) {
+    cache.read(segments);
+    if (!verify_blocks(*inode, data, pos - size, pos, &bad_block)) {
+      return Result<uint>(FS_CORRUPT, bad_block);
+    }
+  } else {
+    // the file can change once we let go of it, so the checksums to
+    // check against are taken now
+    auto full = make_shared<vector<BlockSum>>();
+    if (!verify_partial(*inode, pos - size, pos, full.get(), &bad_block)) {
+      return Result<uint>(FS_CORRUPT, bad_block);
+    }
+    ++pending->parts;
+    cache.read(segments, [this, data, full, pending] () {
+      pending->corrupt = !verify_full(data, *full, &pending->bad_block);
+      pending->finish();
+    });
+  }
+  readahead(desc, pos - size, size);
+  Metrics::count(Metrics::BYTES_READ, size);
+  return size;
 }
 
-void ToyFS::write(vector<string> args) {
-  ops_exactly(2);
+// Called after each read of a descriptor, with the file locked. Reads
+// that carry on where the last one ended are a stream: the first gets
+// the next RA_MIN_BLOCKS blocks read into the cache, and each time the
+// reader gets into the second half of the window, the window after it
+// is read in at twice the size, up to RA_MAX_BLOCKS. Any other read
+// starts over. Reads of half the largest window or more are left
+// alone: they make big enough disk requests already, and the cache
+// streams them past itself.
+void ToyFS::readahead(Descriptor &desc, uint pos, uint size) {
+  bool sequential = pos == desc.next_read;
+  desc.next_read = pos + size;
+  if (!sequential || size == 0 || size >= RA_MAX_BLOCKS / 2 * block_size) {
+    desc.ra_size = 0;
+    return;
+  }
+  const Inode &inode = *desc.inode;
+  uint last = (pos + size - 1) / block_size;
+  uint ra_end = desc.ra_start + desc.ra_size;
+  if (desc.ra_size > 0 && last < ra_end - desc.ra_size / 2) {
+    return;
+  }
+  uint file_blocks = (inode.size + block_size - 1) / block_size;
+  desc.ra_start = desc.ra_size == 0 ? last + 1 : max(ra_end, last + 1);
+  desc.ra_size = desc.ra_size == 0 ? RA_MIN_BLOCKS
+                                   : min(2 * desc.ra_size, RA_MAX_BLOCKS);
+  uint end = min(desc.ra_start + desc.ra_size, file_blocks);
+
+  // the disk runs under the window, skipping holes
+  vector<pair<uint, uint>> runs;
+  for (uint fb = desc.ra_start; fb < end;) {
+    uint disk_block, run;
+    bool mapped = inode.map_block(fb, &disk_block, &run);
+    run = min(run, end - fb);
+    if (mapped) {
+      runs.emplace_back(disk_block, run);
+    }
+    fb += run;
+  }
+  cache.prefetch(runs);
+}
+
+Result<uint> ToyFS::write(uint fd, const char *buf, uint size) {
+  Metrics::Scope measure(metrics, Metrics::WRITE);
+  return checked_write(fd, buf, size, nullptr);
+}
 
-  uint fd;
+Result<uint> ToyFS::checked_write(uint fd, const char *buf, uint size,
+                                  const shared_ptr<Pending> &pending) {
+  // committed when the file is closed
+  Update update(*this, false);
   uint max_size = block_size * (direct_blocks + direct_blocks * direct_blocks);
-  if ( !(istringstream(args[1]) >> fd)) {
-    cerr << "write: error: Unknown descriptor." << endl;
-  } else {
-    auto desc = open_files.find(fd);
-    if (desc == open_files.end()) {
-      cerr << "write: error: File descriptor not open." << endl;
-    } else if (desc->second.mode != W && desc->second.mode != RW) {
-      cerr << "write: error: " << args[1] << " not open for write." << endl;
-    } else if (desc->second.byte_pos + args[2].size() > max_size) {
-      cerr << "write: error: File to large for inode." << endl;
-    } else if (!basic_write(desc->second, args[2])) {
-      cerr << "write: error: Insufficient disk space." << endl;
-    }
+  auto desc = find_descriptor(fd);
+  if (desc == nullptr) {
+    return FS_BAD_FD;
+  } else if (desc->mode != W && desc->mode != RW) {
+    return FS_BAD_MODE;
+  } else if (desc->byte_pos > max_size || size > max_size - desc->byte_pos) {
+    return FS_TOO_LARGE;
+  }
+  uint written = basic_write(*desc, buf, size, pending);
+  if (written == 0 && size > 0) {
+    return FS_NO_SPACE;
   }
+  return written;
 }
 
-uint ToyFS::basic_write(Descriptor &desc, const string data) {
-  const char *bytes = data.c_str();
+// write size bytes at the descriptor's position. Given an async call, the
+// runs streamed to disk are left to the engine; everything else,
+// including the inode and its checksums, is done before returning.
+uint ToyFS::basic_write(Descriptor &desc, const char *bytes, const uint size,
+                        const shared_ptr<Pending> &pending) {
   uint &pos = desc.byte_pos;
-  uint bytes_to_write = data.size();
+  uint bytes_to_write = size;
   uint bytes_written = 0;
-  auto inode = desc.inode.lock();
+  auto &inode = desc.inode;
+  // writing nothing doesn't extend the file, even past its end
+  if (size == 0) {
+    return 0;
+  }
+  lock_guard<mutex> guard(inode->lock);
   uint &file_size = inode->size;
-  uint &file_blocks_used = inode->blocks_used;
-  uint new_size = max(file_size, pos + bytes_to_write);
-  uint new_blocks_used = ceil(static_cast<double>(new_size)/block_size);
-  uint blocks_needed = new_blocks_used - file_blocks_used;
-  uint dbytes = direct_blocks * block_size;
+  uint end = pos + bytes_to_write;
+  uint new_size = max(file_size, end);
+  if (inode->blocks_used == 0 && new_size <= Inode::inline_max) {
+    // small enough to stay in the inode; a gap before pos is zeroes
+    inode->inline_data.resize(new_size);
+    memcpy(&inode->inline_data[pos], bytes, size);
+    pos += size;
+    file_size = new_size;
+    log_inode(desc.from, *inode, {});
+    Metrics::count(Metrics::BYTES_WRITTEN, size);
+    return size;
+  } else if (inode->compressed) {
+    return compressed_write(desc, bytes, size, new_size);
+  }
 
-  // expand the inode to indirect blocks if needed
-  if (blocks_needed && blocks_needed + file_blocks_used > 2) {
-    uint ivec_used = (ceil(min(file_blocks_used - 2, 0U) / static_cast<float>(direct_blocks)));
-    uint ivec_new = (ceil((new_blocks_used - 2) / static_cast<float>(direct_blocks)));
-    while (ivec_used < ivec_new) {
-      inode->i_blocks->push_back(vector<uint>());
-      ivec_used++;
+  // the blocks written over in place won't hold what their fingerprints
+  // say; forgetting them first means nobody starts sharing one of them
+  // after we've checked it isn't shared
+  if (allocator.fingerprinted() > 0) {
+    uint last = (end - 1) / block_size + 1;
+    for (uint fb = pos / block_size; fb < last;) {
+      uint disk_block, run;
+      bool mapped = inode->map_block(fb, &disk_block, &run);
+      run = min(run, last - fb);
+      if (mapped) {
+        allocator.forget(disk_block, run);
+      }
+      fb += run;
+    }
+  }
+
+  // file blocks the write covers whose data is already on disk, as
+  // (file block, disk block) with an owner added to the disk block, and
+  // the fingerprints of the rest
+  vector<pair<uint, uint>> duplicates;
+  vector<pair<uint, uint64_t>> fresh;
+  if (dedup_new) {
+    dedup_blocks(*inode, bytes, pos, end, &duplicates, &fresh);
+  }
+
+  // a block that a committed record or a checkpoint maps is copied on
+  // write, so a crash before the change commits finds the old data under
+  // the old checksums. Once anything from fresh_since on is durable our
+  // records may be too, and our blocks are no longer fresh.
+  if (journal.logged() > desc.fresh_since ||
+      desc.fresh_checkpoint != checkpoints) {
+    desc.fresh_blocks.clear();
+  }
+  if (desc.fresh_blocks.empty()) {
+    desc.fresh_since = journal.position();
+    desc.fresh_checkpoint = checkpoints;
+  }
+
+  // the runs of file blocks that need new blocks, as (file block,
+  // count): the holes the write lands in, blocks that aren't fresh or
+  // are shared with a copy, which can't be written over in place, and
+  // the first block if the inline data has to move there. The inode is
+  // left alone until they have all been allocated.
+  vector<pair<uint, uint>> targets;
+  uint blocks_needed = 0;
+  auto need = [&] (uint fb) {
+    if (!targets.empty() &&
+        targets.back().first + targets.back().second == fb) {
+      ++targets.back().second;
+    } else {
+      targets.emplace_back(fb, 1);
+    }
+    ++blocks_needed;
+  };
+  bool move_inline = !inode->inline_data.empty();
+  if (move_inline && pos >= block_size) {
+    need(0);
+  }
+  uint last = (end - 1) / block_size;
+  auto duplicate = duplicates.begin();
+  for (uint fb = pos / block_size; fb <= last;) {
+    uint disk_block, run, shared_run;
+    bool mapped = inode->map_block(fb, &disk_block, &run);
+    run = min(run, last - fb + 1);
+    bool in_place = false;
+    if (mapped) {
+      in_place = !allocator.is_shared(disk_block, &shared_run);
+      run = min(run, shared_run);
+    }
+    for (uint k = 0; k < run; ++k) {
+      if (duplicate != duplicates.end() && duplicate->first == fb + k) {
+        ++duplicate;
+      } else if (!in_place || !desc.fresh_blocks.count(disk_block + k)) {
+        need(fb + k);
+      }
     }
+    fb += run;
   }
 
   // find space
   vector<pair<uint, uint>> free_chunks;
-  auto fl_it = begin(free_list);
-  while (blocks_needed > 0) {
-    if (fl_it == end(free_list)) {
-      // 0 return because we ran out of free space
-      return 0;}
-    if (fl_it->num_blocks > blocks_needed) {
-      // we found a chunk big enough to hold the rest of our write
-      free_chunks.push_back(make_pair(fl_it->pos, blocks_needed));
-      fl_it->pos += blocks_needed * block_size;
-      fl_it->num_blocks -= blocks_needed;
-      break;
+  if (blocks_needed > 0 && !allocator.allocate(blocks_needed, &free_chunks) &&
+      (!reclaim() || !allocator.allocate(blocks_needed, &free_chunks))) {
+    // nothing has changed but the duplicates' owners
+    for (auto &dup : duplicates) {
+      allocator.free(dup.second, 1);
     }
-    // we have a chunk, but will fill it and need more
-    free_chunks.push_back((make_pair(fl_it->pos, fl_it->num_blocks)));
-    blocks_needed -= fl_it->num_blocks;
-    auto used_entry = fl_it++;
-    free_list.erase(used_entry);
+    // 0 return because we ran out of free space
+    return 0;
   }
 
-  // allocate our blocks
-  for (auto fc_it : free_chunks) {
-    uint block_pos = fc_it.first;
-    uint num_blocks = fc_it.second;
-    for (uint k = 0; k < num_blocks; ++k, ++file_blocks_used, block_pos += block_size) {
-      if (file_blocks_used < direct_blocks) {
-        inode->d_blocks.push_back(block_pos);
-      } else {
-        uint i = ((file_blocks_used - direct_blocks) / direct_blocks);
-        inode->i_blocks->at(i).push_back(block_pos);
+  for (auto &chunk : free_chunks) {
+    for (uint b = chunk.first; b < chunk.first + chunk.second; ++b) {
+      desc.fresh_blocks.insert(b);
+    }
+  }
+
+  // the blocks the write stops using; they are freed once the change
+  // is logged
+  vector<pair<uint, uint>> freed;
+  dedup_hits += duplicates.size();
+  for (auto &dup : duplicates) {
+    uint old_block, run;
+    if (inode->map_block(dup.first, &old_block, &run)) {
+      freed.emplace_back(old_block, 1);
+    }
+    inode->set_blocks(dup.first, dup.second, 1);
+  }
+
+  // map the targets to our blocks, in order. Only the blocks at the
+  // ends of the write (and the one inline data moves to) can be covered
+  // partly: a block that was mapped keeps its old data there, and a
+  // hole reads as zeroes, which new blocks may need clearing for.
+  vector<uint> edges = {pos / block_size, last};
+  if (move_inline) {
+    edges.push_back(0);
+  }
+  vector<char> block(block_size, 0);
+  auto chunk = free_chunks.begin();
+  uint chunk_used = 0;
+  for (auto &target : targets) {
+    for (uint fb = target.first; fb < target.first + target.second;) {
+      uint count = min(target.first + target.second - fb, chunk->second - chunk_used);
+      uint start = chunk->first + chunk_used;
+      for (uint edge : edges) {
+        if (edge < fb || edge >= fb + count ||
+            (edge * block_size >= pos && (edge + 1) * block_size <= end)) {
+          continue;
+        }
+        uint old_block, run;
+        if (inode->map_block(edge, &old_block, &run)) {
+          cache.read(old_block * block_size, block.data(), block_size);
+          cache.write((start + edge - fb) * block_size, block.data(),
+                      block_size);
+        } else if (zero_on_alloc) {
+          memset(block.data(), 0, block_size);
+          cache.write((start + edge - fb) * block_size, block.data(),
+                      block_size);
+        }
+      }
+      for (uint k = 0; k < count;) {
+        uint old_block, run;
+        bool mapped = inode->map_block(fb + k, &old_block, &run);
+        run = min(run, count - k);
+        if (mapped) {
+          freed.emplace_back(old_block, run);
+        }
+        k += run;
       }
+      inode->set_blocks(fb, start, count);
+      fb += count;
+      chunk_used += count;
+      if (chunk_used == chunk->second) {
+        ++chunk;
+        chunk_used = 0;
+      }
+    }
+  }
+  // the ranges of blocks whose checksums change
+  vector<pair<uint, uint>> changed;
+  if (!inode->inline_data.empty()) {
+    // the file has outgrown its inline data; move it to the first block
+    uint disk_block, run;
+    inode->map_block(0, &disk_block, &run);
+    cache.write(disk_block * block_size, inode->inline_data.data(),
+                inode->inline_data.size());
+    inode->inline_data.clear();
+    if (pos >= block_size) {
+      changed.emplace_back(0, 1);
     }
   }
+  changed.emplace_back(pos / block_size, last - pos / block_size + 1);
 
-  // actually write our blocks
+  // actually write our blocks, a segment per extent, leaving out the
+  // duplicates
+  vector<BlockCache::Segment> segments;
+  duplicate = duplicates.begin();
   while (bytes_to_write > 0) {
-    uint write_size = min(block_size - pos % block_size, bytes_to_write);
-    uint write_dest = 0;
-    if (pos < dbytes) {
-      write_dest = inode->d_blocks[pos / block_size] + pos % block_size;
-    } else {
-      uint i = (pos - dbytes) / (direct_blocks * block_size);
-      uint j = (pos - dbytes) / block_size % direct_blocks;
-      write_dest = inode->i_blocks->at(i)[j] + pos % block_size;
+    uint fb = pos / block_size;
+    if (duplicate != duplicates.end() && duplicate->first == fb) {
+      ++duplicate;
+      bytes_written += block_size;
+      bytes_to_write -= block_size;
+      pos += block_size;
+      continue;
+    }
+    uint disk_block, run;
+    bool mapped = inode->map_block(fb, &disk_block, &run);
+    assert(mapped);
+    (void) mapped;
+    if (duplicate != duplicates.end()) {
+      run = min(run, duplicate->first - fb);
     }
-    disk_file.seekp(write_dest);
-    disk_file.write(bytes + bytes_written, write_size);
+    uint offset = pos % block_size;
+    uint write_size = min(run * block_size - offset, bytes_to_write);
+    segments.push_back(BlockCache::Segment{disk_block * block_size + offset,
+                                           const_cast<char *>(bytes + bytes_written),
+                                           write_size});
     bytes_written += write_size;
     bytes_to_write -= write_size;
     pos += write_size;
   }
+  if (pending == nullptr) {
+    cache.write(segments);
+  } else {
+    ++pending->parts;
+    cache.write(segments, [pending] () {pending->finish();});
+  }
+  for (auto &block : fresh) {
+    uint disk_block, run;
+    inode->map_block(block.first, &disk_block, &run);
+    allocator.set_fingerprint(disk_block, block.second);
+  }
+  for (auto &range : changed) {
+    sum_blocks(inode.get(), range.first, range.second, bytes, end - size, end);
+  }
 
-  disk_file.flush();
   file_size = new_size;
+  log_inode(desc.from, *inode, changed);
+  for (auto &run : freed) {
+    allocator.free(run.first, run.second);
+  }
+  Metrics::count(Metrics::BYTES_WRITTEN, bytes_written);
   return bytes_written;
 }
 
-void ToyFS::seek(vector<string> args) {
-  ops_exactly(2);
-  uint fd;
-  if ( !(istringstream(args[1]) >> fd)) {
-    cerr << "seek: error: Unknown descriptor." << endl;
-    return;
+// Every block of a file has its CRC-32C in the inode. Writes sum the
+// blocks they cover completely from the caller's buffer and read the
+// others back once written; reads check the blocks they cover the same
+// way, so data the disk mangled is reported rather than returned.
+
+// set the checksums of file blocks first..first+count-1, after data was
+// written at pos..end
+void ToyFS::sum_blocks(Inode *inode, uint first, uint count,
+                       const char *data, uint pos, uint end) {
+  if (inode->checksums.size() < first + count) {
+    inode->checksums.resize(first + count);
   }
-  auto desc_it = open_files.find(fd);
-  if (desc_it == open_files.end()) {
-    cerr << "seek: error: File descriptor not open." << endl;
-    return;
+  vector<char> block;
+  for (uint fb = first; fb < first + count; ++fb) {
+    uint disk_block, run;
+    if (!inode->map_block(fb, &disk_block, &run)) {
+      continue;
+    }
+    uint start = fb * block_size;
+    if (start >= pos && start + block_size <= end) {
+      inode->checksums[fb] = crc32c(data + (start - pos), block_size);
+      continue;
+    }
+    block.resize(block_size);
+    cache.read(disk_block * block_size, block.data(), block_size);
+    inode->checksums[fb] = crc32c(block.data(), block_size);
   }
-  auto &desc = desc_it->second;
-  uint pos;
-  if (!(istringstream(args[2]) >> pos)) {
-    cerr << "seek: error: Invalid position." << endl;
-  } else if (pos > desc.inode.lock()->size) {
-    cerr << "seek: error: Position outside file." << endl;
-  } else {
-    desc.byte_pos = pos;
+}
+
+// check the blocks covering pos..end, which were just read into data.
+// False, with the disk block in bad_block, if one doesn't match its
+// checksum.
+bool ToyFS::verify_blocks(const Inode &inode, const char *data, uint pos,
+                          uint end, uint *bad_block) {
+  vector<BlockSum> full;
+  return verify_partial(inode, pos, end, &full, bad_block) &&
+      verify_full(data, full, bad_block);
+}
+
+// read the blocks pos..end only covers partly again whole and check
+// them; the ones it covers completely are added to full for checking
+// against the data read
+bool ToyFS::verify_partial(const Inode &inode, uint pos, uint end,
+                           vector<BlockSum> *full, uint *bad_block) {
+  if (pos == end) {
+    return true;
+  }
+  uint last = min<uint>((end - 1) / block_size + 1, inode.checksums.size());
+  vector<char> block;
+  for (uint fb = pos / block_size; fb < last;) {
+    uint disk_block, run;
+    bool mapped = inode.map_block(fb, &disk_block, &run);
+    run = min(run, last - fb);
+    for (uint k = 0; mapped && k < run; ++k) {
+      uint start = (fb + k) * block_size;
+      if (start >= pos && start + block_size <= end) {
+        full->push_back(BlockSum{start - pos, disk_block + k,
+                                 inode.checksums[fb + k]});
+        continue;
+      }
+      block.resize(block_size);
+      cache.read((disk_block + k) * block_size, block.data(), block_size);
+      if (crc32c(block.data(), block_size) != inode.checksums[fb + k]) {
+        *bad_block = disk_block + k;
+        return false;
+      }
+    }
+    fb += run;
   }
+  return true;
 }
 
-bool ToyFS::basic_close(uint fd) {
-  auto kv = open_files.find(fd);
-  if(kv == open_files.end()) {
-    return false;
-  } else {
-    kv->second.from.lock()->is_locked = false;
-    open_files.erase(fd);
+bool ToyFS::verify_full(const char *data, const vector<BlockSum> &full,
+                        uint *bad_block) const {
+  for (auto &sum : full) {
+    if (crc32c(data + sum.offset, block_size) != sum.checksum) {
+      *bad_block = sum.disk_block;
+      return false;
+    }
   }
   return true;
 }
 
+// Deduplication: the full blocks written while it is on are
+// fingerprinted, and the allocator keeps the fingerprint of each block
+// until it is freed or written over. A full block with the fingerprint
+// of one already on disk is compared with it and, if they match, mapped
+// to it as another owner, the same as the blocks of a copy.
+
+// for each block of data (written at pos..end) that the write covers
+// completely, either find a block already holding its data, add an
+// owner to it and add the pair to duplicates, or add its fingerprint to
+// fresh; the inode itself is left alone
+void ToyFS::dedup_blocks(const Inode &inode, const char *data, uint pos,
+                         uint end, vector<pair<uint, uint>> *duplicates,
+                         vector<pair<uint, uint64_t>> *fresh) {
+  uint first = (pos + block_size - 1) / block_size;
+  // inline data is still to be moved to the first block
+  if (first == 0 && !inode.inline_data.empty()) {
+    first = 1;
+  }
+  vector<char> stored(block_size);
+  for (uint fb = first; fb < end / block_size; ++fb) {
+    const char *block = data + (fb * block_size - pos);
+    uint64_t print = fingerprint(block, block_size);
+    ++dedup_hashed;
+    uint match;
+    if (!allocator.share_fingerprint(print, &match)) {
+      fresh->emplace_back(fb, print);
+      continue;
+    }
+    cache.read(match * block_size, stored.data(), block_size);
+    if (memcmp(stored.data(), block, block_size) != 0) {
+      // same fingerprint, different data
+      allocator.free(match, 1);
+      fresh->emplace_back(fb, print);
+      continue;
+    }
+    duplicates->emplace_back(fb, match);
+  }
+}
 
-void ToyFS::close(vector<string> args) {
-  ops_exactly(1);
-  uint fd;
+// Compressed files are stored a cluster of Inode::cluster_blocks blocks
+// at a time, each compressed on its own into as few blocks as it takes.
+// Reading decompresses the clusters the read covers; writing
+// decompresses them, changes them and compresses them again into new
+// blocks, so shared clusters never need copying first.
+
+// make desc.cluster the cluster at index; holes are zeroes. False, with
+// the cluster zeroed, if its blocks fail their checksum.
+bool ToyFS::load_cluster(Descriptor &desc, uint index) {
+  const Inode &inode = *desc.inode;
+  uint cluster_size = Inode::cluster_blocks * block_size;
+  if (desc.cluster_index == index) {
+    return true;
+  }
+  desc.cluster.assign(cluster_size, 0);
+  desc.cluster_index = index;
+  if (index >= inode.clusters.size() || inode.clusters[index].blocks == 0) {
+    return true;
+  }
+  const Inode::Cluster &cluster = inode.clusters[index];
+  bool known = index < inode.checksums.size();
+  if (cluster.bytes == 0) {
+    cache.read(cluster.start * block_size, desc.cluster.data(), cluster_size);
+    if (!known || crc32c(desc.cluster.data(), cluster_size) ==
+        inode.checksums[index]) {
+      return true;
+    }
+  } else {
+    vector<char> packed(cluster.blocks * block_size);
+    cache.read(cluster.start * block_size, packed.data(), packed.size());
+    if ((!known || crc32c(packed.data(), packed.size()) ==
+         inode.checksums[index]) &&
+        lz_decompress(packed.data(), cluster.bytes, desc.cluster.data(),
+                      cluster_size)) {
+      return true;
+    }
+  }
+  desc.cluster.assign(cluster_size, 0);
+  return false;
+}
 
-  if (! (istringstream (args[1]) >> fd)) {
-    cerr << "close: error: File descriptor not recognized" << endl;
+// compress a cluster into new blocks and map it at index in place of
+// the old ones, which are added to freed; false if there is no run of
+// blocks for it
+bool ToyFS::store_cluster(Inode *inode, uint index, const char *data,
+                          vector<pair<uint, uint>> *freed) {
+  uint cluster_size = Inode::cluster_blocks * block_size;
+  // only worth it if it saves a block
+  vector<char> packed(cluster_size - block_size);
+  uint bytes = lz_compress(data, cluster_size, packed.data(), packed.size());
+  uint blocks = bytes > 0 ? (bytes + block_size - 1) / block_size
+                          : Inode::cluster_blocks;
+  uint start;
+  if (!allocator.allocate_run(blocks, &start) &&
+      (!reclaim() || !allocator.allocate_run(blocks, &start))) {
+    return false;
+  }
+  if (bytes > 0) {
+    memset(packed.data() + bytes, 0, blocks * block_size - bytes);
+    cache.write(start * block_size, packed.data(), blocks * block_size);
+    inode->checksums[index] = crc32c(packed.data(), blocks * block_size);
   } else {
-    if (!basic_close(fd)) {
-      cerr << "close: error: File descriptor not open" << endl;
-    } else {
-      cout << "closed " << fd << endl;
+    cache.write(start * block_size, data, cluster_size);
+    inode->checksums[index] = crc32c(data, cluster_size);
+  }
+
+  Inode::Cluster &cluster = inode->clusters[index];
+  if (cluster.blocks > 0) {
+    freed->emplace_back(cluster.start, cluster.blocks);
+  }
+  inode->blocks_used += blocks - cluster.blocks;
+  cluster = Inode::Cluster{start, blocks, bytes};
+  return true;
+}
+
+Result<uint> ToyFS::compressed_read(Descriptor &desc, char *data,
+                                    const uint size) {
+  uint cluster_size = Inode::cluster_blocks * block_size;
+  uint &pos = desc.byte_pos;
+  for (uint done = 0; done < size;) {
+    uint offset = pos % cluster_size;
+    uint n = min(size - done, cluster_size - offset);
+    if (!load_cluster(desc, pos / cluster_size)) {
+      return Result<uint>(FS_CORRUPT,
+                          desc.inode->clusters[pos / cluster_size].start);
     }
+    memcpy(data + done, desc.cluster.data() + offset, n);
+    done += n;
+    pos += n;
   }
+  Metrics::count(Metrics::BYTES_READ, size);
+  return size;
 }
 
-void ToyFS::mkdir(vector<string> args) {
-  ops_at_least(1);
-  /* add each new directory one at a time */
-  for (uint i = 1; i < args.size(); i++) {
-    auto path = parse_path(args[i]);
-    auto node = path->final_node;
-    auto dirname = path->final_name;
-    auto parent = path->parent_node;
+uint ToyFS::compressed_write(Descriptor &desc, const char *bytes,
+                             const uint size, const uint new_size) {
+  Inode &inode = *desc.inode;
+  uint cluster_size = Inode::cluster_blocks * block_size;
+  uint &pos = desc.byte_pos;
+  uint end = pos + size;
+  uint last = (end - 1) / cluster_size;
+  if (inode.clusters.size() <= last) {
+    inode.clusters.resize(last + 1, Inode::Cluster{0, 0, 0});
+  }
+  if (inode.checksums.size() <= last) {
+    inode.checksums.resize(last + 1);
+  }
 
-    if (path->invalid_path) {
-      cerr << "mkdir: error: Invalid path: " << args[i] << endl;
-      return;
-    } else if (node == root_dir) {
-      cerr << "mkdir: error: Cannot recreate root." << endl;
-      return;
-    } else if (node != nullptr) {
-      cerr << "mkdir: error: " << args[i] << " already exists." << endl;
+  // a file outgrowing its inline data moves it to the first cluster
+  bool move_inline = !inode.inline_data.empty();
+  uint written = 0;
+  // the clusters stored, whose checksums change
+  uint first = move_inline ? 0 : pos / cluster_size;
+  uint stored_end = first;
+  vector<pair<uint, uint>> freed;
+  for (uint index = first; index <= last; ++index) {
+    uint cluster_start = index * cluster_size;
+    uint from = max(pos, cluster_start);
+    uint to = min(end, cluster_start + cluster_size);
+    if (from >= to && !(index == 0 && move_inline)) {
       continue;
     }
+    if (from == cluster_start && to == cluster_start + cluster_size) {
+      // overwritten completely, so the old data doesn't matter
+      desc.cluster.resize(cluster_size);
+      desc.cluster_index = index;
+    } else {
+      load_cluster(desc, index);
+    }
+    if (index == 0 && move_inline) {
+      memcpy(desc.cluster.data(), inode.inline_data.data(),
+             inode.inline_data.size());
+    }
+    if (from < to) {
+      memcpy(desc.cluster.data() + from - cluster_start, bytes + from - pos,
+             to - from);
+    }
+    if (!store_cluster(&inode, index, desc.cluster.data(), &freed)) {
+      desc.cluster_index = NO_CLUSTER;
+      break;
+    }
+    stored_end = index + 1;
+    if (index == 0 && move_inline) {
+      inode.inline_data.clear();
+    }
+    written += to > from ? to - from : 0;
+  }
 
-    /* actually add the directory */
-    parent->add_dir(dirname);
+  pos += written;
+  if (written > 0) {
+    inode.size = written == size ? new_size : max(inode.size, pos);
+  }
+  log_inode(desc.from, inode, {{first, stored_end - first}});
+  for (auto &run : freed) {
+    allocator.free(run.first, run.second);
   }
+  Metrics::count(Metrics::BYTES_WRITTEN, written);
+  return written;
 }
 
-void ToyFS::rmdir(vector<string> args) {
-  ops_at_least(1);
+void ToyFS::Pending::finish() {
+  if (--parts > 0) {
+    return;
+  }
+  if (corrupt && result) {
+    promise.set_value(Result<uint>(FS_CORRUPT, bad_block));
+  } else {
+    promise.set_value(result);
+  }
+}
 
-  for (uint i = 1; i < args.size(); i++) {
-    auto path = parse_path(args[i]);
-    auto node = path->final_node;
-    auto parent = path->parent_node;
+future<Result<uint>> ToyFS::async_read(uint fd, char *buf, uint size) {
+  Metrics::Scope measure(metrics, Metrics::READ);
+  auto pending = make_shared<Pending>();
+  auto done = pending->promise.get_future();
+  pending->result = checked_read(fd, buf, size, pending);
+  pending->finish();
+  return done;
+}
 
-    if (node == nullptr) {
-      cerr << "rmdir: error: Invalid path: " << args[i] << endl;
-    } else if (node == root_dir) {
-      cerr << "rmdir: error: Cannot remove root." << endl;
-    } else if (node == pwd) {
-      cerr << "rmdir: error: Cannot remove working directory." << endl;
-    } else if (node->contents.size() > 0) {
-      cerr << "rmdir: error: Directory not empty." << endl;
-    } else if (node->type != dir) {
-      cerr << "rmdir: error: " << node->name << " must be directory." << endl;
-    } else {
-      parent->contents.remove(node);
+future<Result<uint>> ToyFS::async_write(uint fd, const char *buf, uint size) {
+  Metrics::Scope measure(metrics, Metrics::WRITE);
+  auto pending = make_shared<Pending>();
+  auto done = pending->promise.get_future();
+  pending->result = checked_write(fd, buf, size, pending);
+  pending->finish();
+  return done;
+}
+
+FsError ToyFS::seek(uint fd, uint pos) {
+  Metrics::Scope measure(metrics, Metrics::SEEK);
+  auto desc = find_descriptor(fd);
+  if (desc == nullptr) {
+    return FS_BAD_FD;
+  }
+  desc->byte_pos = pos;
+  return FS_OK;
+}
+
+bool ToyFS::basic_close(uint fd) {
+  shared_ptr<DirEntry> node;
+  shared_ptr<Inode> inode;
+  vector<char> cluster;
+  {
+    lock_guard<mutex> guard(fd_lock);
+    if (fd >= max_open || !open_files[fd].in_use) {
+      return false;
     }
+    Descriptor &desc = open_files[fd];
+    // let go of the file once the slot is free, outside the lock
+    node = move(desc.from);
+    inode = move(desc.inode);
+    cluster = move(desc.cluster);
+    desc.in_use = false;
+    lowest_free = min(lowest_free, fd);
   }
+  node->is_locked = false;
+  commit();
+  return true;
 }
 
-void ToyFS::printwd(vector<string> args) {
-  ops_exactly(0);
+FsError ToyFS::close(uint fd) {
+  Metrics::Scope measure(metrics, Metrics::CLOSE);
+  // the file's blocks go if it was unlinked while open
+  Update update(*this);
+  return basic_close(fd) ? FS_OK : FS_BAD_FD;
+}
 
-  if (pwd == root_dir) {
-      cout << "/" << endl;
-      return;
+FsError ToyFS::mkdir(const string &path) {
+  Metrics::Scope measure(metrics, Metrics::MKDIR);
+  Update update(*this);
+  auto parsed = parse_path(path);
+  auto node = parsed->final_node;
+  auto dirname = parsed->final_name;
+  auto parent = parsed->parent_node;
+
+  if (parsed->invalid_path) {
+    return FS_INVALID_PATH;
+  } else if (node == root_dir) {
+    return FS_IS_ROOT;
+  } else if (node != nullptr) {
+    return FS_EXISTS;
   }
 
-  auto wd = pwd;
-  deque<string> plist;
-  while (wd != root_dir) {
-    plist.push_front(wd->name);
-    wd = wd->parent.lock();
+  lock_guard<mutex> ns_guard(namespace_lock);
+  auto new_dir = parent->add_dir(dirname);
+  if (new_dir == nullptr) {
+    // lost a race with another thread
+    return parent->find_child(dirname) != nullptr ? FS_EXISTS
+                                                  : FS_INVALID_PATH;
+  }
+  journal.append(path_record(J_MKDIR, new_dir));
+  dcache_invalidate();
+  return FS_OK;
+}
+
+FsError ToyFS::rmdir(const string &path) {
+  Metrics::Scope measure(metrics, Metrics::RMDIR);
+  Update update(*this);
+  auto parsed = parse_path(path);
+  auto node = parsed->final_node;
+  auto parent = parsed->parent_node;
+
+  if (node == nullptr) {
+    return FS_NOT_FOUND;
+  } else if (node == root_dir) {
+    return FS_IS_ROOT;
+  } else if (node == working_dir()) {
+    return FS_IS_CWD;
+  } else if (node->type != dir) {
+    return FS_NOT_DIR;
   }
 
-  for (auto dirname : plist) {
-      cout << "/" << dirname;
+  lock_guard<mutex> ns_guard(namespace_lock);
+  if (!node->remove_if_empty()) {
+    return FS_NOT_EMPTY;
   }
-  cout << endl;
+  journal.append(path_record(J_RMDIR, node));
+  parent->remove_child(node->name);
+  dcache_invalidate();
+  return FS_OK;
 }
 
-void ToyFS::cd(vector<string> args) {
-  ops_exactly(1);
+string ToyFS::cwd() {
+  Metrics::Scope measure(metrics, Metrics::PWD);
+  return path_of(working_dir());
+}
 
-  auto path = parse_path(args[1]);
-  auto node = path->final_node;
+FsError ToyFS::cd(const string &path) {
+  Metrics::Scope measure(metrics, Metrics::CD);
+  auto node = parse_path(path)->final_node;
 
   if (node == nullptr) {
-    cerr << "cd: error: Invalid path: " << args[1] << endl;
+    return FS_NOT_FOUND;
   } else if (node->type != dir) {
-    cerr << "cd: error: " << args[1] << " must be a directory." << endl;
-  } else {
-    pwd = node;
+    return FS_NOT_DIR;
   }
+  lock_guard<mutex> guard(pwd_lock);
+  pwd = node;
+  return FS_OK;
 }
 
-void ToyFS::link(vector<string> args) {
-  ops_exactly(2);
-
-  auto src_path = parse_path(args[1]);
-  auto src = src_path->final_node;
-  auto src_parent = src_path->parent_node;
-  auto dest_path = parse_path(args[2]);
-  auto dest = dest_path->final_node;
-  auto dest_parent = dest_path->parent_node;
-  auto dest_name = dest_path->final_name;
+FsError ToyFS::link(const string &src_path, const string &dest_path) {
+  Metrics::Scope measure(metrics, Metrics::LINK);
+  Update update(*this);
+  auto src_parsed = parse_path(src_path);
+  auto src = src_parsed->final_node;
+  auto src_parent = src_parsed->parent_node;
+  auto dest_parsed = parse_path(dest_path);
+  auto dest = dest_parsed->final_node;
+  auto dest_parent = dest_parsed->parent_node;
+  auto dest_name = dest_parsed->final_name;
 
   if (src == nullptr) {
-    cerr << "link: error: Cannot find " << args[1] << endl;
+    return FS_NOT_FOUND;
+  } else if (dest_parsed->invalid_path) {
+    return FS_INVALID_PATH;
   } else if (dest != nullptr) {
-    cerr << "link: error: " << args[2] << " already exists." << endl;
+    return FS_EXISTS;
   } else if (src->type != file) {
-    cerr << "link: error: " << args[1] << " must be a file." << endl;
+    return FS_NOT_FILE;
   } else if (src_parent == dest_parent) {
-    cerr << "link: error: src and dest must be in different directories." << endl;
-  } else {
-    auto new_file = DirEntry::make_de_file(dest_name, dest_parent, src->inode);
-    dest_parent->contents.push_back(new_file);
+    return FS_SAME_DIR;
   }
-}
 
-void ToyFS::unlink(vector<string> args) {
-  ops_exactly(1);
+  auto new_file = DirEntry::make_de_file(dest_name, dest_parent, src->inode);
+  lock_guard<mutex> ns_guard(namespace_lock);
+  if (!dest_parent->add_entry(new_file)) {
+    return FS_EXISTS;
+  }
+  MetaWriter record;
+  record.u8(J_LINK);
+  record.str(path_of(src));
+  record.str(path_of(new_file));
+  journal.append(record.buf);
+  dcache_invalidate();
+  return FS_OK;
+}
 
-  auto path = parse_path(args[1]);
-  auto node = path->final_node;
-  auto parent = path->parent_node;
+FsError ToyFS::unlink(const string &path) {
+  Metrics::Scope measure(metrics, Metrics::UNLINK);
+  Update update(*this);
+  auto parsed = parse_path(path);
+  auto node = parsed->final_node;
+  auto parent = parsed->parent_node;
 
   if (node == nullptr) {
-    cerr << "unlink: error: File not found." << endl;
+    return FS_NOT_FOUND;
   } else if (node->type != file) {
-    cerr << "unlink: error: " << args[1] << " must be a file." << endl;
-  } else if (node->is_locked) {
-    cerr << "unlink: error: " << args[1] << " is open." << endl;
-  } else {
-    parent->contents.remove(node);
+    return FS_NOT_FILE;
+  } else if (node->is_locked.exchange(true)) {
+    // claiming the entry also keeps anyone from opening it meanwhile
+    return FS_BUSY;
   }
+  lock_guard<mutex> ns_guard(namespace_lock);
+  journal.append(path_record(J_UNLINK, node));
+  parent->remove_child(node->name);
+  dcache_invalidate();
+  return FS_OK;
 }
 
-void ToyFS::stat(vector<string> args) {
-  ops_at_least(1);
+// what stat reports about an entry
+static ToyFS::FileInfo file_info(const shared_ptr<DirEntry> &node) {
+  ToyFS::FileInfo info;
+  info.name = node->name;
+  info.type = node->type;
+  if (node->type == file) {
+    info.links = node->inode->links;
+    lock_guard<mutex> guard(node->inode->lock);
+    info.inode = reinterpret_cast<uintptr_t>(node->inode.get());
+    info.size = node->inode->size;
+    info.blocks = node->inode->blocks_used;
+    info.allocated = info.blocks * Inode::block_size;
+    info.compressed = node->inode->compressed;
+  }
+  return info;
+}
 
-  for (uint i = 1; i < args.size(); i++) {
-    auto path = parse_path(args[i]);
-    auto node = path->final_node;
+Result<ToyFS::FileInfo> ToyFS::stat(const string &path) {
+  Metrics::Scope measure(metrics, Metrics::STAT);
+  auto node = parse_path(path)->final_node;
+  if (node == nullptr) {
+    return FS_NOT_FOUND;
+  }
+  return file_info(node);
+}
 
-    if (node == nullptr) {
-      cerr << "stat: error: " << args[i] << " not found." << endl;
-    } else {
-      cout << "  File: " << node->name << endl;
-      if (node->type == file) {
-        cout << "  Type: file" << endl;
-        cout << " Inode: " << node->inode.get() << endl;
-        cout << " Links: " << node->inode.use_count() << endl;
-        cout << "  Size: " << node->inode->size << endl;
-        cout << "Blocks: " << node->inode->blocks_used << endl;
-      } else if(node->type == dir) {
-        cout << "  Type: directory" << endl;
-      }
-    }
+Result<ToyFS::FileInfo> ToyFS::fstat(uint fd) {
+  Metrics::Scope measure(metrics, Metrics::STAT);
+  auto desc = find_descriptor(fd);
+  if (desc == nullptr) {
+    return FS_BAD_FD;
   }
+  return file_info(desc->from);
 }
 
-void ToyFS::ls(vector<string> args) {
-  ops_exactly(0);
-  for (auto dir : pwd->contents) {
-    cout << dir->name << endl;
+Result<vector<ToyFS::FileInfo>> ToyFS::list(const string &path) {
+  Metrics::Scope measure(metrics, Metrics::LS);
+  auto node = parse_path(path)->final_node;
+  if (node == nullptr) {
+    return FS_NOT_FOUND;
+  } else if (node->type != dir) {
+    return FS_NOT_DIR;
+  }
+  vector<FileInfo> entries;
+  for (auto &entry : node->entries()) {
+    entries.push_back(file_info(entry));
   }
+  return entries;
 }
 
-void ToyFS::cat(vector<string> args) {
-  ops_at_least(1);
+FsError ToyFS::cp(const string &src_path, const string &dest_path) {
+  Metrics::Scope measure(metrics, Metrics::CP);
+  Update update(*this);
 
-  for(uint i = 1; i < args.size(); i++) {
-    Descriptor desc;
-    if(!basic_open(&desc, vector<string> {args[0], args[i], "r"})) {
-      /* failed to open */
-      continue;
+  Descriptor *src, *dest;
+  FsError error = basic_open(&src, src_path, R);
+  if (error != FS_OK) {
+    return error;
+  }
+  error = basic_open(&dest, dest_path, W);
+  if (error == FS_OK) {
+    // share the source's blocks; either file copies a block when it
+    // next writes to it
+    auto &src_inode = src->inode;
+    auto &dest_inode = dest->inode;
+    if (src_inode != dest_inode) {
+      std::lock(src_inode->lock, dest_inode->lock);
+      lock_guard<mutex> src_guard(src_inode->lock, adopt_lock);
+      lock_guard<mutex> dest_guard(dest_inode->lock, adopt_lock);
+      Inode replaced;
+      dest_inode->clone_blocks(*src_inode, &replaced);
+      log_inode(dest->from, *dest_inode, {{0, dest_inode->checksums.size()}});
     }
-    
-    auto size = desc.inode.lock()->size;
-    read(vector<string>
-            {args[0], std::to_string(desc.fd), std::to_string(size)});
-    basic_close(desc.fd);
+    basic_close(dest->fd);
   }
+  basic_close(src->fd);
+  return error;
 }
 
-void ToyFS::cp(vector<string> args) {
-  ops_exactly(2);
-  
-  Descriptor src, dest;
-  if(basic_open(&src, vector<string> {args[0], args[1], "r"})) {
-    if(!basic_open(&dest, vector<string> {args[0], args[2], "w"})) {
-      basic_close(src.fd);
-    } else {
-      auto data = basic_read(src, src.inode.lock()->size);
-      if (!basic_write(dest, *data)) {
-        cerr << args[0] << ": error: out of free space or file too large"
-             << endl;
-      }
-      basic_close(src.fd);
-      basic_close(dest.fd);
+FsError ToyFS::import(const string &host_file, const string &path) {
+  Metrics::Scope measure(metrics, Metrics::IMPORT);
+  Update update(*this);
+
+  ifstream in(host_file, ifstream::binary);
+  if (!in.is_open()) {
+    return FS_HOST_IO;
+  }
+  // check for space up front rather than failing halfway through
+  in.seekg(0, ifstream::end);
+  uint64_t size = in.tellg();
+  in.seekg(0);
+  if (size > allocator.free_blocks() * static_cast<uint64_t>(block_size)) {
+    return FS_NO_SPACE;
+  }
+
+  Descriptor *desc;
+  FsError error = basic_open(&desc, path, W);
+  if (error != FS_OK) {
+    return error;
+  }
+  // copy a chunk at a time so memory use doesn't grow with the file
+  vector<char> chunk(STREAM_CHUNK);
+  while (in.read(chunk.data(), chunk.size()) || in.gcount() > 0) {
+    if (!basic_write(*desc, chunk.data(), in.gcount())) {
+      error = FS_NO_SPACE;
+      break;
     }
   }
+  basic_close(desc->fd);
+  return error;
 }
 
-void tree_helper(shared_ptr<DirEntry> directory, string indent) {
-  auto cont = directory->contents;
-  if (directory->type == file) {
-    cout << directory->name << ": " << directory->inode->size 
-        << " bytes" << endl;
-  } else {
-    cout << directory->name << endl;
-  }
-  if (cont.size() == 0) return;
+Result<uint> ToyFS::export_file(const string &path, const string &host_file) {
+  Metrics::Scope measure(metrics, Metrics::EXPORT);
 
-  if (cont.size() >= 2) {
-    auto last = *(cont.rbegin());
-    for (auto entry = cont.begin(); *entry != last; entry++) {
-      cout << indent << "├───";
-      tree_helper(*entry, indent + "│   ");
+  ofstream out(host_file, ofstream::binary);
+  if (!out.is_open()) {
+    return FS_HOST_IO;
+  }
+  Descriptor *desc;
+  FsError error = basic_open(&desc, path, R);
+  if (error != FS_OK) {
+    return error;
+  }
+  vector<char> chunk(STREAM_CHUNK);
+  uint size = file_size(desc->inode);
+  Result<uint> result(size);
+  for (uint left = size; left > 0;) {
+    auto n = basic_read(*desc, chunk.data(), min<uint>(left, chunk.size()));
+    if (!n) {
+      result = n;
+      break;
     }
+    out.write(chunk.data(), *n);
+    left -= *n;
   }
+  basic_close(desc->fd);
+  return result;
+}
 
-  cout << indent << "└───";
-  tree_helper(*(cont.rbegin()), indent + "    ");
+void ToyFS::set_compression(bool on) {
+  compress_new = on;
 }
 
-void ToyFS::tree(vector<string> args) {
-  ops_exactly(0);
+bool ToyFS::compression() const {
+  return compress_new;
+}
 
-  tree_helper(pwd, "");
+void ToyFS::set_dedup(bool on) {
+  dedup_new = on;
 }
 
-void ToyFS::import(vector<string> args) {
-  ops_exactly(2);
+bool ToyFS::deduplication() const {
+  return dedup_new;
+}
 
-  Descriptor desc;
-  fstream in(args[1]);
-  if(!in.is_open()) {
-    cerr << args[0] << ": error: Unable to open " << args[1] << endl;
-    return;
-  }
-  if (basic_open(&desc, vector<string>{args[0], args[2], "w"})) {
-    string data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
-    if (!basic_write(desc, data)) {
-      cerr << args[0] << ": error: out of free space or file too large"
-           << endl;
-    }
-    basic_close(desc.fd);
-  }
+ToyFS::DedupInfo ToyFS::dedup_stats() {
+  Metrics::Scope measure(metrics, Metrics::DEDUP);
+  DedupInfo info;
+  info.on = dedup_new;
+  info.fingerprinted = allocator.fingerprinted();
+  info.hashed = dedup_hashed;
+  info.duplicates = dedup_hits;
+  info.saved = static_cast<uint64_t>(info.duplicates) * block_size;
+  return info;
 }
 
-void ToyFS::FS_export(vector<string> args) {
-  ops_exactly(2);
+ToyFS::DcacheInfo ToyFS::dcache_stats() {
+  Metrics::Scope measure(metrics, Metrics::DCACHE);
+  lock_guard<mutex> guard(dcache_lock);
+  return DcacheInfo{static_cast<uint>(dcache.size()), dcache.hits,
+                    dcache.misses};
+}
 
-  Descriptor desc;
-  ofstream out(args[2], ofstream::binary);
-  if (!out.is_open()) {
-    cerr << args[0] << ": error: Unable to open " << args[2] << endl;
-    return;
-  }
+ToyFS::SpaceInfo ToyFS::df() {
+  Metrics::Scope measure(metrics, Metrics::DF);
+  SpaceInfo info;
+  info.total = allocator.total_blocks();
+  info.free = allocator.free_blocks();
+  info.largest = allocator.largest_free_run();
+  info.extents = allocator.free_extents();
+  info.shared = allocator.shared_blocks();
+  info.fragmentation = allocator.fragmentation();
+  return info;
+}
+
+ToyFS::CacheInfo ToyFS::sync() {
+  Metrics::Scope measure(metrics, Metrics::SYNC);
+  CacheInfo info;
+  info.written_back = cache.dirty();
+  checkpoint();
+  info.cached = cache.size();
+  info.hits = cache.hits;
+  info.misses = cache.misses;
+  info.prefetched = cache.prefetched;
+  return info;
+}
 
- if (basic_open(&desc, vector<string>{args[0], args[1], "r"})) {
-   unique_ptr<string> data = basic_read(desc, desc.inode.lock()->size);
-   out << *data;
-   basic_close(desc.fd);
+ToyFS::ScrubInfo ToyFS::scrub() {
+  Metrics::Scope measure(metrics, Metrics::SCRUB);
+  auto started = chrono::steady_clock::now();
+  // nothing may change the inodes or their blocks while we check them
+  lock_guard<SharedMutex> guard(ops_lock);
+
+  // what to check: a block, or the stored blocks of a cluster, and the
+  // checksum they should have
+  struct Check {
+    uint start;
+    uint blocks;
+    uint32_t checksum;
+    bool operator<(const Check &other) const {
+      return start < other.start;
+    }
+    bool operator==(const Check &other) const {
+      return start == other.start && blocks == other.blocks &&
+          checksum == other.checksum;
+    }
+  };
+  vector<Check> checks;
+  unordered_map<const Inode *, uint> numbers;
+  vector<const Inode *> table;
+  collect_inodes(root_dir, &numbers, &table);
+  for (auto inode : table) {
+    auto &sums = inode->checksums;
+    for (auto &ext : inode->extents) {
+      for (uint k = 0; k < ext.length && ext.file_block + k < sums.size(); ++k) {
+        checks.push_back(Check{ext.start + k, 1, sums[ext.file_block + k]});
+      }
+    }
+    for (uint i = 0; i < inode->clusters.size() && i < sums.size(); ++i) {
+      auto &cluster = inode->clusters[i];
+      if (cluster.blocks > 0) {
+        checks.push_back(Check{cluster.start, cluster.blocks, sums[i]});
+      }
+    }
+  }
+  // blocks shared by copies only need checking once
+  sort(begin(checks), end(checks));
+  checks.erase(unique(begin(checks), end(checks)), end(checks));
+
+  // check what is on the disk, not what is in the cache: write the dirty
+  // blocks back, then have each thread take a slice of the disk and read
+  // the runs of adjacent blocks in it a chunk at a time, past the cache
+  cache.flush();
+  auto check_slice = [this, &checks] (size_t from, size_t to,
+                                      vector<uint> *corrupt) {
+    vector<char> data(max(SCRUB_CHUNK, Inode::cluster_blocks) * block_size);
+    while (from < to) {
+      size_t next = from + 1;
+      uint blocks = checks[from].blocks;
+      while (next < to && checks[next].start == checks[from].start + blocks &&
+             blocks + checks[next].blocks <= SCRUB_CHUNK) {
+        blocks += checks[next++].blocks;
+      }
+      disk->read(checks[from].start * block_size, data.data(),
+                 blocks * block_size);
+      const char *p = data.data();
+      for (; from < next; ++from) {
+        uint len = checks[from].blocks * block_size;
+        if (crc32c(p, len) != checks[from].checksum) {
+          corrupt->push_back(checks[from].start);
+        }
+        p += len;
+      }
+    }
+  };
+  uint threads = max(1u, min({thread::hardware_concurrency(), SCRUB_THREADS,
+                              static_cast<uint>(checks.size() / SCRUB_CHUNK)}));
+  vector<vector<uint>> corrupt(threads);
+  vector<future<void>> workers;
+  for (uint t = 0; t < threads; ++t) {
+    workers.push_back(async(launch::async, check_slice,
+                            checks.size() * t / threads,
+                            checks.size() * (t + 1) / threads, &corrupt[t]));
+  }
+  ScrubInfo info;
+  info.blocks = 0;
+  for (auto &check : checks) {
+    info.blocks += check.blocks;
+  }
+  for (uint t = 0; t < threads; ++t) {
+    workers[t].get();
+    info.corrupt.insert(end(info.corrupt), begin(corrupt[t]), end(corrupt[t]));
   }
+  info.bytes = static_cast<uint64_t>(info.blocks) * block_size;
+  info.threads = threads;
+  info.seconds = chrono::duration<double>(chrono::steady_clock::now() -
+                                          started).count();
+  return info;
 }
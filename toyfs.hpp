@@ -1,27 +1,122 @@
 #ifndef _TOYFS_H_
 #define _TOYFS_H_
 
-#include <fstream>
+#include <future>
 #include <list>
-#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_set>
 #include <vector>
+#include "allocator.hpp"
+#include "blockcache.hpp"
 #include "inode.hpp"
+#include "ioengine.hpp"
 #include "direntry.hpp"
-#include "freenode.hpp"
+#include "fserror.hpp"
+#include "journal.hpp"
+#include "lrucache.hpp"
+#include "metrics.hpp"
+#include "ondisk.hpp"
+#include "sharedmutex.hpp"
+#include "storage.hpp"
 
 
+// The commands can be called from several threads at once. Directories
+// and inodes each have their own lock, the allocator and block cache
+// lock themselves, and the working directory and dcache have a lock
+// each. Opening and closing files takes the descriptor table's lock, but
+// looking a descriptor up doesn't, so a descriptor must not be closed
+// while another call is still using it. Commands that change the file
+// system hold ops_lock shared (through Update) so checkpoint can take it
+// exclusively and save a consistent snapshot.
+//
+// Changes are logged to the journal as they are made and committed at
+// the end of each command, except that writes to an open file are
+// committed when it is closed, so an image that wasn't unmounted cleanly
+// comes back as of the last commit. Blocks freed by a change aren't
+// reused until the change is durable.
 class ToyFS {
-
+ public:
   enum Mode {R, W, RW};
+
+  struct FileInfo {
+    std::string name;
+    EntryType type;
+    // the rest is only set for files; inode identifies the file's inode
+    uintptr_t inode = 0;
+    uint links = 0;
+    uint size = 0;
+    // blocks mapped, and the bytes they take; holes and inline data
+    // take none
+    uint blocks = 0;
+    uint allocated = 0;
+    bool compressed = false;
+  };
+  struct SpaceInfo {
+    uint total;
+    uint free;
+    uint largest;   // longest run of free blocks
+    uint extents;   // separate free runs
+    uint shared;    // blocks shared between copies
+    double fragmentation;
+  };
+  struct CacheInfo {
+    uint written_back;
+    uint cached;
+    uint hits;
+    uint misses;
+    uint prefetched;  // blocks read ahead
+  };
+  struct DedupInfo {
+    bool on;
+    uint fingerprinted;  // blocks with a fingerprint on record
+    uint hashed;         // full blocks fingerprinted by writes
+    uint duplicates;     // of those, blocks mapped to existing ones
+    uint64_t saved;      // bytes the duplicates didn't take
+  };
+  struct ScrubInfo {
+    uint blocks;           // file blocks checked
+    uint64_t bytes;        // and their size
+    uint threads;
+    double seconds;
+    std::vector<uint> corrupt;  // blocks, or first blocks of clusters,
+                                // that failed their checksum
+  };
+  struct DcacheInfo {
+    uint entries;
+    uint hits;
+    uint misses;
+  };
+
+ private:
+  // a slot of the descriptor table; while it is in use it holds on to
+  // the file's entry and inode, so calls on the descriptor needn't
+  // check they still exist
   struct Descriptor {
+    std::atomic<bool> in_use{false};
     Mode mode;
     uint byte_pos;
-    std::weak_ptr<Inode> inode;
-    std::weak_ptr<DirEntry> from;
+    std::shared_ptr<Inode> inode;
+    std::shared_ptr<DirEntry> from;
     uint fd;
+    // readahead: where a sequential read would start next, and the
+    // window of file blocks last read ahead
+    uint next_read;
+    uint ra_start;
+    uint ra_size;
+    // the cluster of a compressed file last decompressed, kept for the
+    // next read or write of it
+    uint cluster_index;
+    std::vector<char> cluster;
+    // the blocks this descriptor's writes have allocated since the
+    // journal position fresh_since and checkpoint fresh_checkpoint.
+    // Nothing durable maps them yet, so they can be written over in
+    // place; every other block is copied on write.
+    std::unordered_set<uint> fresh_blocks;
+    uint64_t fresh_since;
+    uint fresh_checkpoint;
   };
-  bool getMode(Mode *mode, std::string mode_s);
 
   struct PathRet {
     bool invalid_path = false;
@@ -30,50 +125,227 @@ class ToyFS {
     std::shared_ptr<DirEntry> final_node;
   };
 
+  // parse_path results keyed by (starting directory, path string)
+  typedef std::pair<const DirEntry *, std::string> DcacheKey;
+  struct DcacheKeyHash {
+    size_t operator()(const DcacheKey &key) const;
+  };
+
+  // held by commands that change the file system, like a reader of
+  // ops_lock; on the way out it commits what they logged, unless told
+  // not to, and takes the checkpoint the journal needs if it has run
+  // out of room
+  class Update {
+    ToyFS &fs;
+    const bool commit;
+   public:
+    explicit Update(ToyFS &fs, bool commit = true);
+    ~Update();
+    Update(const Update &) = delete;
+    Update &operator=(const Update &) = delete;
+  };
+
+  // an async_read or async_write: its future is ready once both the
+  // call that started it has returned and the transfers it handed to
+  // the engine have finished, whichever is last
+  struct Pending {
+    std::promise<Result<uint>> promise;
+    std::atomic<uint> parts{1};
+    // what the call returned, and the block a read found corrupt once
+    // its data was in
+    Result<uint> result{0u};
+    bool corrupt = false;
+    uint bad_block = 0;
+    void finish();
+  };
+
+  // a block a read covers completely: where it is in the read's buffer,
+  // its disk block and the checksum it should have
+  struct BlockSum {
+    uint offset;
+    uint disk_block;
+    uint32_t checksum;
+  };
+
+  // geometry of the image; magic is only set for an existing image or
+  // once it has been formatted
+  Superblock super;
+  // why the image couldn't be mounted, or FS_OK
+  FsError status = FS_OK;
   const std::string filename;
-  std::fstream disk_file;
   const uint block_size;
   const uint direct_blocks;
   const uint num_blocks;
+  std::unique_ptr<Storage> disk;
+  // batches the cache's disk transfers; null for plain synchronous I/O
+  std::unique_ptr<IOEngine> engine;
+  BlockCache cache;
+  Journal journal;
 
   // DirEntry root;
-  std::list<FreeNode>free_list;
+  BlockAllocator allocator;
   std::shared_ptr<DirEntry> root_dir;
+  mutable std::mutex pwd_lock;
   std::shared_ptr<DirEntry> pwd;
-  std::map<uint, Descriptor> open_files;
-  uint next_descriptor = 0;
+  std::mutex fd_lock;
+  const uint max_open;
+  // indexed by fd and never resized
+  std::unique_ptr<Descriptor[]> open_files;
+  // every descriptor below this one is in use
+  uint lowest_free = 0;
+  mutable std::mutex dcache_lock;
+  mutable LRUCache<DcacheKey, PathRet, DcacheKeyHash> dcache;
+  // bumped by every invalidation, so a lookup that raced with one
+  // doesn't cache a stale result
+  uint dcache_generation = 0;
+  SharedMutex ops_lock;
+  // held across a change to the tree and its journal record, so the
+  // records replay in the order the changes were made
+  std::mutex namespace_lock;
+  // blocks holding the metadata written by the last checkpoint
+  std::vector<std::pair<uint, uint>> meta_runs;
+  // set when the image can't punch holes for freed blocks
+  bool zero_on_alloc = false;
+  // whether files created from now on are compressed
+  std::atomic<bool> compress_new{false};
+  // whether writes look for blocks already on disk with their data
+  std::atomic<bool> dedup_new{false};
+  std::atomic<uint> dedup_hashed{0};
+  std::atomic<uint> dedup_hits{0};
+  // bumped by every checkpoint
+  uint checkpoints = 0;
 
-  void init_disk(const std::string& filename);
+  static Superblock image_geometry(const std::string &filename,
+                                   const uint fs_size,
+                                   const uint block_size,
+                                   const uint direct_blocks,
+                                   const bool format);
+  void format_disk();
+  bool mount();
+  bool checkpoint();
+  void commit();
+  bool reclaim();
+  void write_superblock();
+  void discard_blocks(uint start, uint count);
+  void dcache_invalidate();
+  void log_inode(const std::shared_ptr<DirEntry> &entry, const Inode &inode,
+                 const std::vector<std::pair<uint, uint>> &changed);
+  bool replay(const std::string &record);
+  void rebuild_allocator();
+  void compute_checksums();
+  std::shared_ptr<DirEntry> working_dir() const;
+  Descriptor *find_descriptor(uint fd);
   std::unique_ptr<PathRet> parse_path(std::string path_str) const;
-  bool basic_open(Descriptor *d, std::vector <std::string> args);
-  std::unique_ptr<std::string> basic_read(Descriptor &desc, const uint size);
-  uint basic_write(Descriptor &desc, const std::string data);
+  FsError basic_open(Descriptor **d, const std::string &path, Mode mode);
+  Result<uint> checked_read(uint fd, char *buf, uint size,
+                            const std::shared_ptr<Pending> &pending);
+  Result<uint> checked_write(uint fd, const char *buf, uint size,
+                             const std::shared_ptr<Pending> &pending);
+  Result<uint> basic_read(Descriptor &desc, char *data, const uint size,
+                          const std::shared_ptr<Pending> &pending = nullptr);
+  void readahead(Descriptor &desc, uint pos, uint size);
+  bool load_cluster(Descriptor &desc, uint index);
+  bool store_cluster(Inode *inode, uint index, const char *data,
+                     std::vector<std::pair<uint, uint>> *freed);
+  Result<uint> compressed_read(Descriptor &desc, char *data, const uint size);
+  uint compressed_write(Descriptor &desc, const char *bytes, const uint size,
+                        const uint new_size);
+  uint basic_write(Descriptor &desc, const char *data, const uint size,
+                   const std::shared_ptr<Pending> &pending = nullptr);
+  void sum_blocks(Inode *inode, uint first, uint count, const char *data,
+                  uint pos, uint end);
+  bool verify_blocks(const Inode &inode, const char *data, uint pos, uint end,
+                     uint *bad_block);
+  bool verify_partial(const Inode &inode, uint pos, uint end,
+                      std::vector<BlockSum> *full, uint *bad_block);
+  bool verify_full(const char *data, const std::vector<BlockSum> &full,
+                   uint *bad_block) const;
+  void dedup_blocks(const Inode &inode, const char *data, uint pos,
+                    uint end, std::vector<std::pair<uint, uint>> *duplicates,
+                    std::vector<std::pair<uint, uint64_t>> *fresh);
   bool basic_close(uint fd);
 
  public:
   ToyFS(const std::string& filename,
         const uint fs_size,
         const uint block_size,
-        const uint direct_blocks);
+        const uint direct_blocks,
+        const uint cache_blocks = 1024,
+        const StorageMode mode = file_mode,
+        const bool format = false,
+        const bool async_io = false,
+        const uint max_open = 1024,
+        const uint inline_max = 60);
   ~ToyFS();
-  void open(std::vector<std::string> args);
-  void read(std::vector<std::string> args);
-  void write(std::vector<std::string> args);
-  void seek(std::vector<std::string> args);
-  void close(std::vector<std::string> args);
-  void mkdir(std::vector<std::string> args);
-  void rmdir(std::vector<std::string> args);
-  void cd(std::vector<std::string> args);
-  void link(std::vector<std::string> args);
-  void unlink(std::vector<std::string> args);
-  void stat(std::vector<std::string> args);
-  void ls(std::vector<std::string> args);
-  void cat(std::vector<std::string> args);
-  void cp(std::vector<std::string> args);
-  void tree(std::vector<std::string> args);
-  void import(std::vector<std::string> args);
-  void printwd(std::vector<std::string> args);
-  void FS_export(std::vector<std::string> args);
+
+  // FS_OK, or why the image was refused: FS_HOST_IO if it couldn't be
+  // opened or created, or why an existing one couldn't be mounted. A
+  // refused image is left untouched and no other call may be made.
+  FsError mount_status() const { return status; }
+
+  // counts and times every call below; see Metrics
+  Metrics metrics;
+
+  // Paths are absolute or relative to the working directory. Calls that
+  // can fail return FS_OK or an error, or a Result holding either the
+  // value or the error.
+
+  // open a file, creating it in mode W; the descriptor starts at 0 and
+  // is the lowest one not in use, as in POSIX
+  Result<uint> open(const std::string &path, Mode mode);
+  // read or write size bytes at the descriptor's position and move it
+  // on; reads may not go past the end of the file, and fail with
+  // FS_CORRUPT, holding the disk block, if a block doesn't match its
+  // checksum
+  Result<uint> read(uint fd, char *buf, uint size);
+  Result<uint> write(uint fd, const char *buf, uint size);
+  // the same, returning once the transfers from or to the disk have
+  // been handed to the I/O engine; the future is ready when they have
+  // finished. buf must stay valid until then, and fd unused but for
+  // close, which waits for the writes in flight as it commits them.
+  // Without an engine, or for inline and compressed files, the
+  // transfers are done before returning.
+  std::future<Result<uint>> async_read(uint fd, char *buf, uint size);
+  std::future<Result<uint>> async_write(uint fd, const char *buf, uint size);
+  // move the position; past the end of the file, a write leaves a hole
+  // that reads as zeroes and takes no blocks
+  FsError seek(uint fd, uint pos);
+  FsError close(uint fd);
+  FsError mkdir(const std::string &path);
+  // remove an empty directory
+  FsError rmdir(const std::string &path);
+  FsError cd(const std::string &path);
+  std::string cwd();
+  // another name for a file, in a different directory
+  FsError link(const std::string &src_path, const std::string &dest_path);
+  FsError unlink(const std::string &path);
+  Result<FileInfo> stat(const std::string &path);
+  Result<FileInfo> fstat(uint fd);
+  // the entries of a directory, in the order they were added
+  Result<std::vector<FileInfo>> list(const std::string &path = ".");
+  // a copy that shares the source's blocks until either is written
+  FsError cp(const std::string &src_path, const std::string &dest_path);
+  // copy a file in from, or out to, the host file system
+  FsError import(const std::string &host_file, const std::string &path);
+  // export returns the bytes copied, and fails like read
+  Result<uint> export_file(const std::string &path,
+                           const std::string &host_file);
+  SpaceInfo df();
+  // checkpoint and write everything cached back to the image
+  CacheInfo sync();
+  // compress the files created from now on, or stop; files keep the
+  // way they were created
+  void set_compression(bool on);
+  bool compression() const;
+  // share the full blocks written from now on with blocks already
+  // holding the same data, or stop; compressed files are left out
+  void set_dedup(bool on);
+  bool deduplication() const;
+  DedupInfo dedup_stats();
+  // check every block files use on disk against its checksum, on
+  // several threads; writes wait until it is done
+  ScrubInfo scrub();
+  DcacheInfo dcache_stats();
 };
 
 #endif /* _TOYFS_H_ */